@@ -6,14 +6,30 @@ extern "C" {
 #endif
 
 #include <errno.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 
+#define JSONTOK_DEFAULT_MAX_DEPTH 1024
+
+/* Leave strings and numbers below the root undecoded until they are read */
+#define JSON_PARSE_LAZY 0x1
+/* Strip whitespace from the text of wrapped objects and arrays as it is copied */
+#define JSON_PARSE_MINIFY 0x2
+
+/* Features that need POSIX files, memory maps and threads; define JSONTOK_NO_POSIX to leave them out */
+#if !defined(JSONTOK_NO_POSIX) && (defined(__unix__) || defined(__APPLE__))
+#define JSONTOK_POSIX
+#endif
+
 enum JsonError {
   JSON_ENOERR,
   JSON_EFMT,
   JSON_ENOMEM,
   JSON_ETYPE,
+  JSON_EDEPTH,
+  JSON_EIO,
+  JSON_ELIMIT,
 };
 
 enum JsonType {
@@ -35,8 +51,11 @@ struct JsonArray {
 };
 
 struct JsonEntry {
+  /* NUL-terminated unless lazy, when it is a span of the parsed text read through jsontok_entry_key */
   char *key;
   struct JsonToken *value;
+  size_t key_length;
+  unsigned char lazy;
 };
 
 struct JsonObject {
@@ -46,15 +65,124 @@ struct JsonObject {
 
 struct JsonToken {
   enum JsonType type : 4;
+  /* Strings and object keys point into the buffer given to jsontok_parse_insitu */
+  unsigned int insitu : 1;
+  /* Strings and numbers holding as_raw until read through jsontok_as_* */
+  unsigned int lazy : 1;
+  unsigned int escaped : 1;
+  /* Numbers holding as_int64 after an exact read through jsontok_as_int64 */
+  unsigned int integer : 1;
   union {
     struct JsonObject *as_object;
     struct JsonArray *as_array;
     char *as_string;
     double as_number;
+    int64_t as_int64;
     unsigned char as_boolean;
+    const char *as_raw;
   };
 };
 
+/**
+ * Memory routines used for every allocation made while parsing and freeing.
+ * ctx is passed back to each of them unchanged.
+ */
+struct JsonAllocator {
+  void *(*alloc)(void *ctx, size_t size);
+  void *(*realloc)(void *ctx, void *ptr, size_t size);
+  void (*free)(void *ctx, void *ptr);
+  void *ctx;
+};
+
+/**
+ * Settings shared by the jsontok_parser_* functions. A zero-initialized
+ * parser uses malloc, realloc and free and JSONTOK_DEFAULT_MAX_DEPTH.
+ * flags is a combination of JSON_PARSE_* values.
+ *
+ * The remaining limits apply to each call and are unlimited when 0. A parse
+ * that would go over one stops at that point with JSON_ELIMIT. max_bytes
+ * counts every allocation and reallocation at its requested size,
+ * max_string_length the raw bytes of a string or key, and max_document_size
+ * the bytes of the input.
+ */
+struct JsonParser {
+  const struct JsonAllocator *allocator;
+  size_t max_depth;
+  unsigned int flags;
+  size_t max_bytes;
+  size_t max_tokens;
+  size_t max_string_length;
+  size_t max_document_size;
+};
+
+enum JsonEventType {
+  JSON_EVENT_START_OBJECT,
+  JSON_EVENT_END_OBJECT,
+  JSON_EVENT_START_ARRAY,
+  JSON_EVENT_END_ARRAY,
+  JSON_EVENT_KEY,
+  JSON_EVENT_STRING,
+  JSON_EVENT_NUMBER,
+  JSON_EVENT_BOOLEAN,
+  JSON_EVENT_NULL,
+};
+
+/**
+ * A single step of a cursor walk. Keys and strings are spans into the input
+ * between the quotes, with escapes left as written.
+ */
+struct JsonEvent {
+  enum JsonEventType type;
+  const char *string;
+  size_t length;
+  double number;
+  unsigned char boolean;
+};
+
+enum JsonCursorState {
+  JSON_CURSOR_VALUE,
+  JSON_CURSOR_KEY,
+  JSON_CURSOR_AFTER_VALUE,
+  JSON_CURSOR_DONE,
+};
+
+/**
+ * Forward-only position in a JSON document. All state is held inline, one bit
+ * per open container, so a cursor never allocates.
+ */
+struct JsonCursor {
+  const char *ptr;
+  const char *end;
+  const char *opened;
+  size_t depth;
+  enum JsonCursorState state;
+  enum JsonError error;
+  unsigned char in_object[JSONTOK_DEFAULT_MAX_DEPTH / 8];
+};
+
+enum JsonSaxAction {
+  JSON_SAX_CONTINUE,
+  JSON_SAX_SKIP,
+};
+
+/**
+ * Callbacks for jsontok_sax_parse. Any of them may be NULL. Keys and strings
+ * are spans into the input between the quotes, with escapes left as written.
+ * Returning JSON_SAX_SKIP from start_object or start_array skips that
+ * container without its end event, and from key skips the key's value.
+ */
+struct JsonSaxHandler {
+  enum JsonSaxAction (*start_object)(void *ctx);
+  enum JsonSaxAction (*end_object)(void *ctx);
+  enum JsonSaxAction (*start_array)(void *ctx);
+  enum JsonSaxAction (*end_array)(void *ctx);
+  enum JsonSaxAction (*key)(void *ctx, const char *key, size_t length);
+  enum JsonSaxAction (*string)(void *ctx, const char *string, size_t length);
+  enum JsonSaxAction (*number)(void *ctx, double number);
+  enum JsonSaxAction (*boolean)(void *ctx, unsigned char boolean);
+  enum JsonSaxAction (*null)(void *ctx);
+};
+
 /**
  * @brief Looks up the error message string corresponding to the error code.
  *
@@ -87,6 +215,385 @@ struct JsonToken *jsontok_get(struct JsonObject *object, const char *key);
  */
 struct JsonToken *jsontok_parse(const char *json_string, enum JsonError *error);
 
+/**
+ * @brief Parses a JSON string and every layer below it into a single tree.
+ *
+ * Nested objects and arrays become JSON_OBJECT and JSON_ARRAY tokens instead
+ * of wrapped substrings. Parsing is driven by an explicit stack of max_depth
+ * frames allocated up front, so deep inputs cannot overflow the call stack.
+ *
+ * @param json_string The JSON string to parse.
+ * @param max_depth The maximum container nesting, or 0 for JSONTOK_DEFAULT_MAX_DEPTH.
+ *                  A stack too large to allocate fails with JSON_ENOMEM.
+ * @return A pointer to a JsonToken representing the parsed JSON, or NULL if an error occurs.
+ */
+struct JsonToken *jsontok_parse_deep(const char *json_string, size_t max_depth, enum JsonError *error);
+
+/**
+ * @brief Parses a mutable JSON string in place and returns a JsonToken.
+ *
+ * Strings and keys are decoded inside json_string and the returned tokens
+ * point into it, so they need no allocation. The buffer is destroyed by the
+ * parse and must outlive the returned token.
+ *
+ * @param json_string The JSON string to parse, overwritten while parsing.
+ * @return A pointer to a JsonToken representing the parsed JSON, or NULL if an error occurs.
+ */
+struct JsonToken *jsontok_parse_insitu(char *json_string, enum JsonError *error);
+
+/**
+ * @brief Parses a JSON string like jsontok_parse, allocating through parser.
+ *
+ * @param parser The parser settings, or NULL for the defaults.
+ * @param json_string The JSON string to parse.
+ * @return A pointer to a JsonToken to be freed with jsontok_parser_free, or NULL if an error occurs.
+ */
+struct JsonToken *jsontok_parser_parse(const struct JsonParser *parser, const char *json_string, enum JsonError *error);
+
+/**
+ * @brief Parses a mutable JSON string in place like jsontok_parse_insitu, allocating through parser.
+ *
+ * @param parser The parser settings, or NULL for the defaults.
+ * @param json_string The JSON string to parse, overwritten while parsing.
+ * @return A pointer to a JsonToken to be freed with jsontok_parser_free, or NULL if an error occurs.
+ */
+struct JsonToken *jsontok_parser_parse_insitu(const struct JsonParser *parser, char *json_string, enum JsonError *error);
+
+/**
+ * @brief Parses every layer of a JSON string like jsontok_parse_deep, allocating through parser.
+ *
+ * @param parser The parser settings, or NULL for the defaults.
+ * @param json_string The JSON string to parse.
+ * @return A pointer to a JsonToken to be freed with jsontok_parser_free, or NULL if an error occurs.
+ */
+struct JsonToken *jsontok_parser_parse_deep(const struct JsonParser *parser, const char *json_string, enum JsonError *error);
+
+/**
+ * @brief Frees a JsonToken returned by one of the jsontok_parser_* functions.
+ *
+ * @param parser The parser the token was parsed with.
+ * @param token The JsonToken to be freed.
+ */
+void jsontok_parser_free(const struct JsonParser *parser, struct JsonToken *token);
+
+/**
+ * @brief Replaces a wrapped object or array with its parsed next layer, in place.
+ *
+ * The wrapped text is freed, so the next layer is never lazy.
+ *
+ * @param parser The parser the token was parsed with, or NULL for the defaults.
+ * @param token The JSON_WRAPPED_OBJECT or JSON_WRAPPED_ARRAY token to expand.
+ * @return JSON_ENOERR, or the error that left the token unchanged.
+ */
+enum JsonError jsontok_parser_expand(const struct JsonParser *parser, struct JsonToken *token);
+
+/**
+ * @brief Removes the whitespace outside of strings from JSON text.
+ *
+ * The output is never longer than the input, so out may be buf to minify in
+ * place. The output is not NUL terminated.
+ *
+ * @param buf The JSON text, which does not need to be NUL terminated.
+ * @param len The length of buf in bytes.
+ * @param out The buffer receiving at least len bytes, or buf itself.
+ * @return The length of the minified text written to out.
+ */
+size_t jsontok_minify(const char *buf, size_t len, char *out);
+
+/**
+ * @brief Reads a string token, decoding it first if it was parsed with JSON_PARSE_LAZY.
+ *
+ * A lazy token keeps pointing into the parsed text until it is read, so that
+ * text must outlive it. Reading a lazy token updates it and is not thread-safe.
+ *
+ * @param parser The parser the token was parsed with, or NULL for the defaults.
+ * @param token The JSON_STRING token to read.
+ * @return The decoded string owned by the token, or NULL if an error occurs.
+ */
+const char *jsontok_as_string(const struct JsonParser *parser, struct JsonToken *token, enum JsonError *error);
+
+/**
+ * @brief Reads the key of an object entry, copying it out first if it was parsed with JSON_PARSE_LAZY.
+ *
+ * Lazy keys without escapes are kept as spans of the parsed text, which
+ * jsontok_get compares without copying. Reading one updates the entry and is
+ * not thread-safe.
+ *
+ * @param parser The parser the entry was parsed with, or NULL for the defaults.
+ * @param entry The entry whose key to read.
+ * @return The NUL-terminated key owned by the entry, or NULL if an error occurs.
+ */
+const char *jsontok_entry_key(const struct JsonParser *parser, struct JsonEntry *entry, enum JsonError *error);
+
+/**
+ * @brief Reads a number token, converting it first if it was parsed with JSON_PARSE_LAZY.
+ *
+ * @param token The JSON_NUMBER token to read.
+ * @return The value of the number, or 0 if an error occurs.
+ */
+double jsontok_as_double(struct JsonToken *token, enum JsonError *error);
+
+/**
+ * @brief Reads a number token as a signed 64-bit integer.
+ *
+ * Lazy integer literals are converted exactly, without going through a double,
+ * and the result is kept in as_int64. Numbers that are fractional or out of
+ * range fail with JSON_ETYPE.
+ *
+ * @param token The JSON_NUMBER token to read.
+ * @return The value of the number, or 0 if an error occurs.
+ */
+int64_t jsontok_as_int64(struct JsonToken *token, enum JsonError *error);
+
+/**
+ * Supplies the input of jsontok_parser_parse_source in pieces. read fills
+ * buffer with up to size bytes and returns how many it wrote, 0 at the end
+ * of the input or (size_t)-1 on failure.
+ */
+struct JsonSource {
+  size_t (*read)(void *ctx, char *buffer, size_t size);
+  void *ctx;
+};
+
+/**
+ * @brief Creates a cursor positioned before the first value of a JSON document.
+ *
+ * @param buf The JSON text, which does not need to be NUL terminated.
+ * @param len The length of buf in bytes.
+ * @return The cursor, to be advanced with jsontok_cursor_next.
+ */
+struct JsonCursor jsontok_cursor_init(const char *buf, size_t len);
+
+/**
+ * @brief Reads the next event of the document.
+ *
+ * Nesting is limited to JSONTOK_DEFAULT_MAX_DEPTH.
+ *
+ * @param cursor The cursor to advance.
+ * @param event Filled with the event that was read.
+ * @return 1 if an event was read, or 0 at the end of the document or on error, in which case cursor->error is set.
+ */
+unsigned char jsontok_cursor_next(struct JsonCursor *cursor, struct JsonEvent *event);
+
+/**
+ * @brief Skips the value following a key event, or the rest of the container opened by the last event.
+ *
+ * A skipped container does not report its end event.
+ *
+ * @param cursor The cursor to advance.
+ * @return 1 if something was skipped, or 0 if the cursor is not before a value or on error, in which case cursor->error is set.
+ */
+unsigned char jsontok_cursor_skip(struct JsonCursor *cursor);
+
+/**
+ * @brief Walks a JSON document and reports it to handler as events, without building a tree.
+ *
+ * Nothing is allocated. Nesting is limited to JSONTOK_DEFAULT_MAX_DEPTH.
+ *
+ * @param buf The JSON text, which does not need to be NUL terminated.
+ * @param len The length of buf in bytes.
+ * @param handler The callbacks to invoke.
+ * @param ctx Passed through to every callback.
+ * @return JSON_ENOERR on success or the error that stopped the walk.
+ */
+enum JsonError jsontok_sax_parse(const char *buf, size_t len, const struct JsonSaxHandler *handler, void *ctx);
+
+#ifdef JSONTOK_POSIX
+/* A read-only document mapped from a file written by jsontok_snapshot_write */
+struct JsonSnapshot;
+
+/* A value inside a JsonSnapshot, valid until the snapshot is closed */
+struct JsonSnapshotNode;
+
+/**
+ * @brief Serializes a parsed document into the binary snapshot format.
+ *
+ * Wrapped objects and arrays are expanded while writing, so the snapshot
+ * always holds the whole document. The format uses offsets rather than
+ * pointers and the host byte order.
+ *
+ * @param token The document to serialize.
+ * @param fd The file descriptor to write to.
+ * @return JSON_ENOERR on success or the error that stopped the write.
+ */
+enum JsonError jsontok_snapshot_write(const struct JsonToken *token, int fd);
+
+/**
+ * @brief Maps a snapshot file for read-only access without parsing it.
+ *
+ * Only the header is validated; snapshot files are trusted input.
+ *
+ * @param path The file written by jsontok_snapshot_write.
+ * @return The snapshot, or NULL if an error occurs.
+ */
+struct JsonSnapshot *jsontok_snapshot_open(const char *path, enum JsonError *error);
+
+/**
+ * @brief Unmaps a snapshot, invalidating all of its nodes.
+ *
+ * @param snapshot The snapshot to close.
+ */
+void jsontok_snapshot_close(struct JsonSnapshot *snapshot);
+
+/**
+ * @brief Returns the top-level value of a snapshot.
+ */
+const struct JsonSnapshotNode *jsontok_snapshot_root(const struct JsonSnapshot *snapshot);
+
+/**
+ * @brief Returns the type of a node, never a wrapped type.
+ */
+enum JsonType jsontok_snapshot_type(const struct JsonSnapshotNode *node);
+
+/**
+ * @brief Returns the byte length of a string, the length of an array or the count of an object.
+ */
+size_t jsontok_snapshot_length(const struct JsonSnapshotNode *node);
+
+/**
+ * @brief Returns the NUL-terminated text of a string node.
+ */
+const char *jsontok_snapshot_string(const struct JsonSnapshotNode *node);
+
+/**
+ * @brief Returns the value of a number node.
+ */
+double jsontok_snapshot_number(const struct JsonSnapshotNode *node);
+
+/**
+ * @brief Returns the value of a boolean node.
+ */
+unsigned char jsontok_snapshot_boolean(const struct JsonSnapshotNode *node);
+
+/**
+ * @brief Returns an array element in O(1), or NULL if out of range.
+ */
+const struct JsonSnapshotNode *jsontok_snapshot_element(const struct JsonSnapshotNode *node, size_t index);
+
+/**
+ * @brief Returns the key of an object entry in document order, or NULL if out of range.
+ */
+const char *jsontok_snapshot_key(const struct JsonSnapshotNode *node, size_t index);
+
+/**
+ * @brief Returns the value of an object entry in document order, or NULL if out of range.
+ */
+const struct JsonSnapshotNode *jsontok_snapshot_value(const struct JsonSnapshotNode *node, size_t index);
+
+/**
+ * @brief Looks up a key in an object node through its hash table.
+ *
+ * @param node The object node to search.
+ * @param key The key to find.
+ * @return The value associated with the key, or NULL if not found.
+ */
+const struct JsonSnapshotNode *jsontok_snapshot_get(const struct JsonSnapshotNode *node, const char *key);
+
+/**
+ * @brief Looks up a key whose hash is already known, such as one computed at compile time.
+ *
+ * @param node The object node to search.
+ * @param key The key to find, which does not need to be NUL terminated.
+ * @param length The length of key in bytes.
+ * @param hash The 32-bit FNV-1a hash of the key.
+ * @return The value associated with the key, or NULL if not found.
+ */
+const struct JsonSnapshotNode *jsontok_snapshot_get_hashed(const struct JsonSnapshotNode *node, const char *key, size_t length, uint32_t hash);
+
+/* A thread-safe cache of parsed documents keyed on their exact contents */
+struct JsonCache;
+
+struct JsonCacheStats {
+  size_t hits;
+  size_t misses;
+  size_t evictions;
+  size_t entries;
+  size_t bytes;
+};
+
+/**
+ * @brief Creates an empty document cache.
+ *
+ * @param budget The approximate number of bytes the cached documents may use
+ * before the least recently used ones that are not in use are evicted.
+ * @return The cache, or NULL if out of memory.
+ */
+struct JsonCache *jsontok_cache_create(size_t budget);
+
+/**
+ * @brief Frees a cache and every document in it, which must all have been released.
+ *
+ * @param cache The cache to free.
+ */
+void jsontok_cache_destroy(struct JsonCache *cache);
+
+/**
+ * @brief Parses a JSON string like jsontok_parse, sharing the result with identical earlier inputs.
+ *
+ * Inputs are matched on a hash of their bytes, their length and a full
+ * comparison. The returned document is shared and read-only; it must be
+ * handed back with jsontok_cache_release instead of jsontok_free, but any
+ * wrapped substrings may be parsed as usual.
+ *
+ * @param cache The cache to look in.
+ * @param json_string The JSON string to parse.
+ * @return A pointer to the shared JsonToken, or NULL if an error occurs.
+ */
+const struct JsonToken *jsontok_cache_parse(struct JsonCache *cache, const char *json_string, enum JsonError *error);
+
+/**
+ * @brief Releases a document returned by jsontok_cache_parse.
+ *
+ * @param cache The cache the document came from.
+ * @param token The document to release.
+ */
+void jsontok_cache_release(struct JsonCache *cache, const struct JsonToken *token);
+
+/**
+ * @brief Reads the hit, miss and eviction counters and current usage of a cache.
+ *
+ * @param cache The cache to inspect.
+ * @param stats Filled with a consistent copy of the counters.
+ */
+void jsontok_cache_stats(struct JsonCache *cache, struct JsonCacheStats *stats);
+
+/**
+ * @brief Parses a document like jsontok_parser_parse while it is still being read.
+ *
+ * source is read on a separate thread into a few fixed-size chunks while the
+ * calling thread parses the top-level members that have fully arrived.
+ * Besides the tree, only the chunks and the member being read are held, and
+ * large members become wrapped text without another copy, so a document that
+ * is one big member still peaks near its size plus the chunks.
+ * JSON_PARSE_LAZY is ignored.
+ *
+ * @param parser The parser settings, or NULL for the defaults.
+ * @param source The input, read from another thread.
+ * @return A pointer to a JsonToken to be freed with jsontok_parser_free, or NULL if an error occurs.
+ */
+struct JsonToken *jsontok_parser_parse_source(const struct JsonParser *parser, const struct JsonSource *source, enum JsonError *error);
+
+/* Reading gzip files needs zlib; define JSONTOK_ZLIB and link with -lz to build it */
+#ifdef JSONTOK_ZLIB
+/**
+ * @brief Parses a gzip-compressed JSON file, decompressing and parsing in parallel.
+ *
+ * @param path The path of the file.
+ * @return A pointer to a JsonToken representing the parsed JSON, or NULL if an error occurs.
+ */
+struct JsonToken *jsontok_parse_gzip_file(const char *path, enum JsonError *error);
+
+/**
+ * @brief Parses a gzip-compressed JSON file like jsontok_parse_gzip_file, allocating through parser.
+ *
+ * @param parser The parser settings, or NULL for the defaults.
+ * @param path The path of the file.
+ * @return A pointer to a JsonToken to be freed with jsontok_parser_free, or NULL if an error occurs.
+ */
+struct JsonToken *jsontok_parser_parse_gzip_file(const struct JsonParser *parser, const char *path, enum JsonError *error);
+#endif
+#endif
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,327 @@
+#ifndef JSONTOK_HPP
+#define JSONTOK_HPP
+
+/**
+ * Optional C++17 facade over jsontok.h. Every type here is a handle onto the
+ * C structures and never copies or allocates beyond what the C calls do.
+ */
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string_view>
+
+#include "jsontok.h"
+
+namespace jsontok {
+
+/**
+ * An object key with its length and FNV-1a hash, both worked out at compile
+ * time for string literals. Token objects use the length to compare keys
+ * without strlen; snapshot objects also use the hash for their tables.
+ */
+class Key {
+ public:
+  /* The length stops at the first NUL, so arrays holding shorter keys work too */
+  template <std::size_t N>
+  constexpr Key(const char (&literal)[N]) : data_(literal), length_(length(literal, N)), hash_(hash(literal, length_)) {}
+  constexpr Key(std::string_view key) : data_(key.data()), length_(key.size()), hash_(hash(key.data(), key.size())) {}
+
+  constexpr const char *data() const { return data_; }
+  constexpr std::size_t length() const { return length_; }
+  constexpr std::uint32_t hash() const { return hash_; }
+
+  static constexpr std::size_t length(const char *data, std::size_t size) {
+    std::size_t count = 0;
+    while (count < size && data[count] != '\0') count++;
+    return count;
+  }
+
+  static constexpr std::uint32_t hash(const char *data, std::size_t length) {
+    std::uint32_t hash = 2166136261u;
+    for (std::size_t i = 0; i < length; i++) {
+      hash ^= static_cast<unsigned char>(data[i]);
+      hash *= 16777619u;
+    }
+    return hash;
+  }
+
+ private:
+  const char *data_;
+  std::size_t length_;
+  std::uint32_t hash_;
+};
+
+namespace literals {
+constexpr Key operator""_key(const char *data, std::size_t length) { return Key(std::string_view(data, length)); }
+}  // namespace literals
+
+inline bool is_wrapped(const JsonToken *token) { return token->type == JSON_WRAPPED_OBJECT || token->type == JSON_WRAPPED_ARRAY; }
+
+/**
+ * A non-owning view of a token inside a Document. Reading through a Value
+ * expands wrapped objects and arrays and decodes lazy scalars in the tree,
+ * so it is not thread-safe. An empty Value stands for a missing result.
+ */
+class Value {
+ public:
+  class Elements;
+  class Entries;
+
+  Value() : token_(nullptr), parser_(nullptr) {}
+  Value(JsonToken *token, const JsonParser *parser) : token_(token), parser_(parser) {}
+
+  explicit operator bool() const { return token_ != nullptr; }
+  JsonToken *token() const { return token_; }
+
+  JsonType type() const {
+    if (token_ && is_wrapped(token_)) return token_->type == JSON_WRAPPED_OBJECT ? JSON_OBJECT : JSON_ARRAY;
+    return token_ ? token_->type : JSON_NULL;
+  }
+  bool is_object() const { return token_ && type() == JSON_OBJECT; }
+  bool is_array() const { return token_ && type() == JSON_ARRAY; }
+  bool is_string() const { return token_ && token_->type == JSON_STRING; }
+  bool is_number() const { return token_ && token_->type == JSON_NUMBER; }
+  bool is_boolean() const { return token_ && token_->type == JSON_BOOLEAN; }
+  bool is_null() const { return token_ && token_->type == JSON_NULL; }
+
+  /* Views the decoded string owned by the token, or an empty view if this is not a string */
+  std::string_view string(JsonError *error = nullptr) const {
+    JsonError ignored;
+    const char *string = jsontok_as_string(parser_, token_, error ? error : &ignored);
+    return string ? std::string_view(string) : std::string_view();
+  }
+  double number(JsonError *error = nullptr) const {
+    JsonError ignored;
+    return jsontok_as_double(token_, error ? error : &ignored);
+  }
+  std::int64_t int64(JsonError *error = nullptr) const {
+    JsonError ignored;
+    return jsontok_as_int64(token_, error ? error : &ignored);
+  }
+  bool boolean() const { return is_boolean() && token_->as_boolean; }
+
+  /* The number of elements or entries, or 0 for scalars */
+  std::size_t size() const {
+    if (!expand()) return 0;
+    return token_->type == JSON_ARRAY ? token_->as_array->length : token_->as_object->count;
+  }
+
+  Value operator[](std::size_t index) const {
+    if (!expand() || token_->type != JSON_ARRAY || index >= token_->as_array->length) return Value();
+    return Value(token_->as_array->elements[index], parser_);
+  }
+
+  Value operator[](Key key) const {
+    if (!expand() || token_->type != JSON_OBJECT) return Value();
+    JsonEntry **entries = token_->as_object->entries;
+    for (std::size_t i = 0; i < token_->as_object->count; i++) {
+      /* Entries know their key length, so most candidates are ruled out before any bytes are read */
+      const JsonEntry *entry = entries[i];
+      if (entry->key_length != key.length() || (key.length() && entry->key[0] != key.data()[0])) continue;
+      if (!std::memcmp(entry->key, key.data(), key.length())) return Value(entry->value, parser_);
+    }
+    return Value();
+  }
+
+  Elements elements() const;
+  Entries entries() const;
+
+ private:
+  /* Makes the token a plain container if it is a wrapped one */
+  bool expand() const {
+    if (!token_) return false;
+    if (is_wrapped(token_)) return jsontok_parser_expand(parser_, token_) == JSON_ENOERR;
+    return token_->type == JSON_ARRAY || token_->type == JSON_OBJECT;
+  }
+
+  JsonToken *token_;
+  const JsonParser *parser_;
+};
+
+/* The argument of range-for over an object */
+struct Entry {
+  std::string_view key;
+  Value value;
+};
+
+class Value::Elements {
+ public:
+  class iterator {
+   public:
+    iterator(JsonToken **ptr, const JsonParser *parser) : ptr_(ptr), parser_(parser) {}
+    Value operator*() const { return Value(*ptr_, parser_); }
+    iterator &operator++() {
+      ptr_++;
+      return *this;
+    }
+    bool operator!=(const iterator &other) const { return ptr_ != other.ptr_; }
+
+   private:
+    JsonToken **ptr_;
+    const JsonParser *parser_;
+  };
+
+  Elements(JsonArray *array, const JsonParser *parser) : array_(array), parser_(parser) {}
+  iterator begin() const { return iterator(array_ ? array_->elements : nullptr, parser_); }
+  iterator end() const { return iterator(array_ ? array_->elements + array_->length : nullptr, parser_); }
+
+ private:
+  JsonArray *array_;
+  const JsonParser *parser_;
+};
+
+class Value::Entries {
+ public:
+  class iterator {
+   public:
+    iterator(JsonEntry **ptr, const JsonParser *parser) : ptr_(ptr), parser_(parser) {}
+    Entry operator*() const { return Entry{std::string_view((*ptr_)->key, (*ptr_)->key_length), Value((*ptr_)->value, parser_)}; }
+    iterator &operator++() {
+      ptr_++;
+      return *this;
+    }
+    bool operator!=(const iterator &other) const { return ptr_ != other.ptr_; }
+
+   private:
+    JsonEntry **ptr_;
+    const JsonParser *parser_;
+  };
+
+  Entries(JsonObject *object, const JsonParser *parser) : object_(object), parser_(parser) {}
+  iterator begin() const { return iterator(object_ ? object_->entries : nullptr, parser_); }
+  iterator end() const { return iterator(object_ ? object_->entries + object_->count : nullptr, parser_); }
+
+ private:
+  JsonObject *object_;
+  const JsonParser *parser_;
+};
+
+/* Iterates over nothing unless this is an array */
+inline Value::Elements Value::elements() const {
+  return Value::Elements(expand() && token_->type == JSON_ARRAY ? token_->as_array : nullptr, parser_);
+}
+
+/* Iterates over nothing unless this is an object */
+inline Value::Entries Value::entries() const {
+  return Value::Entries(expand() && token_->type == JSON_OBJECT ? token_->as_object : nullptr, parser_);
+}
+
+/**
+ * Owns a parsed tree and frees it with jsontok_parser_free. The parser, and
+ * for lazy or in situ parses the source text, must outlive the document.
+ */
+class Document {
+ public:
+  Document() : root_(nullptr), parser_(nullptr) {}
+  Document(JsonToken *root, const JsonParser *parser) : root_(root), parser_(parser) {}
+  Document(const Document &) = delete;
+  Document &operator=(const Document &) = delete;
+  Document(Document &&other) noexcept : root_(other.root_), parser_(other.parser_) { other.root_ = nullptr; }
+  Document &operator=(Document &&other) noexcept {
+    if (this != &other) {
+      jsontok_parser_free(parser_, root_);
+      root_ = other.root_;
+      parser_ = other.parser_;
+      other.root_ = nullptr;
+    }
+    return *this;
+  }
+  ~Document() { jsontok_parser_free(parser_, root_); }
+
+  static Document parse(const char *json, JsonError *error = nullptr, const JsonParser *parser = nullptr) {
+    JsonError ignored;
+    return Document(jsontok_parser_parse(parser, json, error ? error : &ignored), parser);
+  }
+  static Document parse_insitu(char *json, JsonError *error = nullptr, const JsonParser *parser = nullptr) {
+    JsonError ignored;
+    return Document(jsontok_parser_parse_insitu(parser, json, error ? error : &ignored), parser);
+  }
+  static Document parse_deep(const char *json, JsonError *error = nullptr, const JsonParser *parser = nullptr) {
+    JsonError ignored;
+    return Document(jsontok_parser_parse_deep(parser, json, error ? error : &ignored), parser);
+  }
+
+  explicit operator bool() const { return root_ != nullptr; }
+  Value root() const { return Value(root_, parser_); }
+  Value operator[](std::size_t index) const { return root()[index]; }
+  Value operator[](Key key) const { return root()[key]; }
+
+  /* Gives up ownership of the tree, which is then freed with jsontok_parser_free */
+  JsonToken *release() {
+    JsonToken *root = root_;
+    root_ = nullptr;
+    return root;
+  }
+
+ private:
+  JsonToken *root_;
+  const JsonParser *parser_;
+};
+
+#ifdef JSONTOK_POSIX
+/* A view of a node inside a Snapshot; an empty node stands for a missing result */
+class SnapshotNode {
+ public:
+  SnapshotNode() : node_(nullptr) {}
+  explicit SnapshotNode(const JsonSnapshotNode *node) : node_(node) {}
+
+  explicit operator bool() const { return node_ != nullptr; }
+  JsonType type() const { return node_ ? jsontok_snapshot_type(node_) : JSON_NULL; }
+  std::size_t size() const { return node_ ? jsontok_snapshot_length(node_) : 0; }
+
+  /* Views the string stored in the snapshot, or an empty view if this is not a string */
+  std::string_view string() const {
+    if (type() != JSON_STRING) return std::string_view();
+    return std::string_view(jsontok_snapshot_string(node_), jsontok_snapshot_length(node_));
+  }
+  double number() const { return node_ ? jsontok_snapshot_number(node_) : 0; }
+  bool boolean() const { return node_ && jsontok_snapshot_boolean(node_); }
+
+  SnapshotNode operator[](std::size_t index) const { return SnapshotNode(node_ ? jsontok_snapshot_element(node_, index) : nullptr); }
+  SnapshotNode operator[](Key key) const {
+    return SnapshotNode(node_ ? jsontok_snapshot_get_hashed(node_, key.data(), key.length(), key.hash()) : nullptr);
+  }
+
+ private:
+  const JsonSnapshotNode *node_;
+};
+
+/* Owns a mapped snapshot and closes it with jsontok_snapshot_close */
+class Snapshot {
+ public:
+  Snapshot() : snapshot_(nullptr) {}
+  explicit Snapshot(JsonSnapshot *snapshot) : snapshot_(snapshot) {}
+  Snapshot(const Snapshot &) = delete;
+  Snapshot &operator=(const Snapshot &) = delete;
+  Snapshot(Snapshot &&other) noexcept : snapshot_(other.snapshot_) { other.snapshot_ = nullptr; }
+  Snapshot &operator=(Snapshot &&other) noexcept {
+    if (this != &other) {
+      if (snapshot_) jsontok_snapshot_close(snapshot_);
+      snapshot_ = other.snapshot_;
+      other.snapshot_ = nullptr;
+    }
+    return *this;
+  }
+  ~Snapshot() {
+    if (snapshot_) jsontok_snapshot_close(snapshot_);
+  }
+
+  static Snapshot open(const char *path, JsonError *error = nullptr) {
+    JsonError ignored;
+    return Snapshot(jsontok_snapshot_open(path, error ? error : &ignored));
+  }
+
+  explicit operator bool() const { return snapshot_ != nullptr; }
+  SnapshotNode root() const { return SnapshotNode(snapshot_ ? jsontok_snapshot_root(snapshot_) : nullptr); }
+  SnapshotNode operator[](std::size_t index) const { return root()[index]; }
+  SnapshotNode operator[](Key key) const { return root()[key]; }
+
+ private:
+  JsonSnapshot *snapshot_;
+};
+#endif
+
+}  // namespace jsontok
+
+#endif
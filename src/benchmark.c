@@ -1,3 +1,7 @@
+#if !defined(_POSIX_C_SOURCE) && (defined(__unix__) || defined(__APPLE__))
+#define _POSIX_C_SOURCE 200809L
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -5,6 +9,14 @@
 
 #include "jsontok.h"
 
+#ifdef JSONTOK_POSIX
+#include <pthread.h>
+#include <unistd.h>
+#ifdef JSONTOK_ZLIB
+#include <zlib.h>
+#endif
+#endif
+
 char *read_file(const char *path) {
   FILE *file = fopen(path, "r");
   if (!file) return NULL;
@@ -26,6 +38,494 @@ char *read_file(const char *path) {
   return buffer;
 }
 
+size_t expand_layers(const char *json) {
+  enum JsonError error;
+  struct JsonToken *token = jsontok_parse(json, &error);
+  if (token == NULL) return 0;
+  size_t count = 1;
+  size_t i;
+  if (token->type == JSON_ARRAY) {
+    for (i = 0; i < token->as_array->length; i++) {
+      struct JsonToken *element = token->as_array->elements[i];
+      count += element->type >= JSON_WRAPPED_OBJECT ? expand_layers(element->as_string) : 1;
+    }
+  } else if (token->type == JSON_OBJECT) {
+    for (i = 0; i < token->as_object->count; i++) {
+      struct JsonToken *value = token->as_object->entries[i]->value;
+      count += value->type >= JSON_WRAPPED_OBJECT ? expand_layers(value->as_string) : 1;
+    }
+  }
+  jsontok_free(token);
+  return count;
+}
+
+size_t count_tokens(const struct JsonToken *token) {
+  size_t count = 1;
+  size_t i;
+  if (token->type == JSON_ARRAY) {
+    for (i = 0; i < token->as_array->length; i++) count += count_tokens(token->as_array->elements[i]);
+  } else if (token->type == JSON_OBJECT) {
+    for (i = 0; i < token->as_object->count; i++) count += count_tokens(token->as_object->entries[i]->value);
+  }
+  return count;
+}
+
+void benchmark_deep(const char *path) {
+  char *json = read_file(path);
+  if (json == NULL) {
+    fprintf(stderr, "Failed to get %s\n", path);
+    return;
+  }
+  clock_t start = clock();
+  size_t layered_tokens = expand_layers(json);
+  clock_t end = clock();
+  double layered = (double)(end - start) * 1e9 / CLOCKS_PER_SEC;
+
+  enum JsonError error;
+  start = clock();
+  struct JsonToken *token = jsontok_parse_deep(json, 0, &error);
+  jsontok_free(token);
+  end = clock();
+  if (token == NULL) {
+    free(json);
+    fprintf(stderr, "Failed to deep parse JSON: %s\n", jsontok_strerror(error));
+    return;
+  }
+  double deep = (double)(end - start) * 1e9 / CLOCKS_PER_SEC;
+  token = jsontok_parse_deep(json, 0, &error);
+  size_t deep_tokens = count_tokens(token);
+  jsontok_free(token);
+  printf("Expanded %s layer by layer: %.1fns/token (%zu tokens), deep: %.1fns/token (%zu tokens)\n\n", path, layered / layered_tokens, layered_tokens, deep / deep_tokens, deep_tokens);
+  free(json);
+}
+
+void benchmark_cursor(const char *path) {
+  char *json = read_file(path);
+  if (json == NULL) {
+    fprintf(stderr, "Failed to get %s\n", path);
+    return;
+  }
+  size_t bytes = strlen(json);
+  enum JsonError error;
+  clock_t start = clock();
+  struct JsonToken *token = jsontok_parse_deep(json, 0, &error);
+  jsontok_free(token);
+  clock_t end = clock();
+  long tree = ((end - start) * 1000000) / CLOCKS_PER_SEC;
+
+  struct JsonCursor cursor = jsontok_cursor_init(json, bytes);
+  struct JsonEvent event;
+  size_t events = 0;
+  start = clock();
+  while (jsontok_cursor_next(&cursor, &event)) events++;
+  end = clock();
+  long walk = ((end - start) * 1000000) / CLOCKS_PER_SEC;
+  if (cursor.error != JSON_ENOERR) {
+    free(json);
+    fprintf(stderr, "Failed to walk JSON: %s\n", jsontok_strerror(cursor.error));
+    return;
+  }
+  printf("Walked %s: tree %ldus, cursor %ldus (%zu events)\n\n", path, tree, walk, events);
+  free(json);
+}
+
+void benchmark_lazy(const char *path) {
+  char *json = read_file(path);
+  if (json == NULL) {
+    fprintf(stderr, "Failed to get %s\n", path);
+    return;
+  }
+  struct JsonParser parser;
+  memset(&parser, 0, sizeof(parser));
+  enum JsonError error;
+  clock_t start = clock();
+  struct JsonToken *token = jsontok_parser_parse_deep(&parser, json, &error);
+  jsontok_parser_free(&parser, token);
+  clock_t end = clock();
+  long eager = ((end - start) * 1000000) / CLOCKS_PER_SEC;
+
+  parser.flags = JSON_PARSE_LAZY;
+  start = clock();
+  token = jsontok_parser_parse_deep(&parser, json, &error);
+  jsontok_parser_free(&parser, token);
+  end = clock();
+  long lazy = ((end - start) * 1000000) / CLOCKS_PER_SEC;
+  if (token == NULL) {
+    free(json);
+    fprintf(stderr, "Failed to parse JSON: %s\n", jsontok_strerror(error));
+    return;
+  }
+  printf("Parsed %s: eager %ldus, lazy %ldus\n\n", path, eager, lazy);
+  free(json);
+}
+
+/* Reads three fields out of every wide record, where lazy keys and values skip most of the decoding */
+long read_wide_records(struct JsonParser *parser, const char *json, size_t records) {
+  enum JsonError error;
+  clock_t start = clock();
+  struct JsonToken *token = jsontok_parser_parse_deep(parser, json, &error);
+  if (token == NULL) {
+    fprintf(stderr, "Failed to parse JSON: %s\n", jsontok_strerror(error));
+    return -1;
+  }
+  size_t total = 0, i;
+  for (i = 0; i < records; i++) {
+    struct JsonObject *record = token->as_array->elements[i]->as_object;
+    total += (size_t)jsontok_as_int64(jsontok_get(record, "id"), &error);
+    total += strlen(jsontok_as_string(parser, jsontok_get(record, "name"), &error));
+    total += strlen(jsontok_as_string(parser, jsontok_get(record, "field_31"), &error));
+  }
+  jsontok_parser_free(parser, token);
+  clock_t end = clock();
+  return total ? ((end - start) * 1000000) / CLOCKS_PER_SEC : -1;
+}
+
+void benchmark_lazy_fields(size_t records, size_t fields) {
+  char *json = malloc(records * (fields + 2) * 48 + 3);
+  if (json == NULL) {
+    fprintf(stderr, "Failed to allocate records\n");
+    return;
+  }
+  char *out = json;
+  size_t i, j;
+  *out++ = '[';
+  for (i = 0; i < records; i++) {
+    out += sprintf(out, "%s{\"id\":%zu,\"name\":\"record number %zu\"", i ? "," : "", i, i);
+    for (j = 0; j < fields; j++) out += sprintf(out, ",\"field_%zu\":\"value %zu of record %zu\"", j, j, i);
+    *out++ = '}';
+  }
+  *out++ = ']';
+  *out = '\0';
+
+  struct JsonParser parser;
+  memset(&parser, 0, sizeof(parser));
+  long eager = read_wide_records(&parser, json, records);
+  parser.flags = JSON_PARSE_LAZY;
+  long lazy = read_wide_records(&parser, json, records);
+  printf("Read 3 of %zu fields from %zu records: eager %ldus, lazy %ldus\n\n", fields + 2, records, eager, lazy);
+  free(json);
+}
+
+char *indent(const char *json) {
+  size_t length = strlen(json);
+  /* Each '{', '[' or ',' grows to six bytes */
+  char *out = malloc(length * 6 + 1);
+  if (out == NULL) return NULL;
+  char *dst = out;
+  unsigned char in_string = 0;
+  for (; *json; json++) {
+    *dst++ = *json;
+    if (in_string) {
+      if (*json == '\\') {
+        *dst++ = *++json;
+      } else if (*json == '"') {
+        in_string = 0;
+      }
+    } else if (*json == '"') {
+      in_string = 1;
+    } else if (*json == ',' || *json == '{' || *json == '[' || *json == ':') {
+      memcpy(dst, *json == ':' ? " " : "\n    ", *json == ':' ? 1 : 5);
+      dst += *json == ':' ? 1 : 5;
+    }
+  }
+  *dst = '\0';
+  return out;
+}
+
+size_t wrapped_bytes(const struct JsonToken *token) {
+  size_t bytes = 0;
+  size_t i;
+  if (token->type == JSON_ARRAY) {
+    for (i = 0; i < token->as_array->length; i++) {
+      struct JsonToken *element = token->as_array->elements[i];
+      if (element->type >= JSON_WRAPPED_OBJECT) bytes += strlen(element->as_string);
+    }
+  } else if (token->type == JSON_OBJECT) {
+    for (i = 0; i < token->as_object->count; i++) {
+      struct JsonToken *value = token->as_object->entries[i]->value;
+      if (value->type >= JSON_WRAPPED_OBJECT) bytes += strlen(value->as_string);
+    }
+  }
+  return bytes;
+}
+
+/* The byte-at-a-time loop jsontok_minify falls back to, as a baseline */
+size_t minify_scalar(const char *buf, size_t len, char *out) {
+  const char *end = buf + len;
+  char *dst = out;
+  unsigned char in_string = 0;
+  while (buf != end) {
+    char c = *buf++;
+    if (in_string) {
+      *dst++ = c;
+      if (c == '"') {
+        in_string = 0;
+      } else if (c == '\\' && buf != end) {
+        *dst++ = *buf++;
+      }
+    } else if (c != ' ' && c != '\n' && c != '\t' && c != '\r') {
+      *dst++ = c;
+      in_string = c == '"';
+    }
+  }
+  return dst - out;
+}
+
+#define MINIFY_RUNS 100
+
+void benchmark_minify(const char *path) {
+  char *source = read_file(path);
+  if (source == NULL) {
+    fprintf(stderr, "Failed to get %s\n", path);
+    return;
+  }
+  char *json = indent(source);
+  free(source);
+  if (json == NULL) return;
+  size_t bytes = strlen(json);
+  char *out = malloc(bytes);
+  size_t minified = 0;
+  int i;
+  clock_t start = clock();
+  for (i = 0; i < MINIFY_RUNS; i++) minified = jsontok_minify(json, bytes, out);
+  clock_t end = clock();
+  long elapsed = ((end - start) * 1000000) / CLOCKS_PER_SEC / MINIFY_RUNS;
+  start = clock();
+  for (i = 0; i < MINIFY_RUNS; i++) minify_scalar(json, bytes, out);
+  end = clock();
+  long scalar = ((end - start) * 1000000) / CLOCKS_PER_SEC / MINIFY_RUNS;
+  free(out);
+
+  struct JsonParser parser;
+  memset(&parser, 0, sizeof(parser));
+  enum JsonError error;
+  struct JsonToken *token = jsontok_parser_parse(&parser, json, &error);
+  if (token == NULL) {
+    free(json);
+    fprintf(stderr, "Failed to parse JSON: %s\n", jsontok_strerror(error));
+    return;
+  }
+  size_t plain = wrapped_bytes(token);
+  jsontok_parser_free(&parser, token);
+  parser.flags = JSON_PARSE_MINIFY;
+  token = jsontok_parser_parse(&parser, json, &error);
+  size_t compact = wrapped_bytes(token);
+  jsontok_parser_free(&parser, token);
+  printf("Minified indented %s: %zu to %zu bytes in %ldus (byte loop %ldus), wrapped text %zu to %zu bytes\n\n", path, bytes, minified, elapsed, scalar, plain, compact);
+  free(json);
+}
+
+#ifdef JSONTOK_POSIX
+void benchmark_snapshot(const char *path) {
+  char *json = read_file(path);
+  if (json == NULL) {
+    fprintf(stderr, "Failed to get %s\n", path);
+    return;
+  }
+  enum JsonError error;
+  clock_t start = clock();
+  struct JsonToken *token = jsontok_parse_deep(json, 0, &error);
+  clock_t end = clock();
+  free(json);
+  if (token == NULL) {
+    fprintf(stderr, "Failed to deep parse JSON: %s\n", jsontok_strerror(error));
+    return;
+  }
+  long parse = ((end - start) * 1000000) / CLOCKS_PER_SEC;
+
+  char snapshot_path[] = "/tmp/jsontok_benchmark_XXXXXX";
+  int fd = mkstemp(snapshot_path);
+  error = fd < 0 ? JSON_EIO : jsontok_snapshot_write(token, fd);
+  jsontok_free(token);
+  if (fd >= 0) close(fd);
+  if (error != JSON_ENOERR) {
+    unlink(snapshot_path);
+    fprintf(stderr, "Failed to write snapshot: %s\n", jsontok_strerror(error));
+    return;
+  }
+
+  start = clock();
+  struct JsonSnapshot *snapshot = jsontok_snapshot_open(snapshot_path, &error);
+  end = clock();
+  unlink(snapshot_path);
+  if (snapshot == NULL) {
+    fprintf(stderr, "Failed to open snapshot: %s\n", jsontok_strerror(error));
+    return;
+  }
+  long open = ((end - start) * 1000000) / CLOCKS_PER_SEC;
+  printf("Loaded %s: deep parse %ldus, snapshot open %ldus\n\n", path, parse, open);
+  jsontok_snapshot_close(snapshot);
+}
+#endif
+
+#ifdef JSONTOK_POSIX
+#define ARENA_CAPACITY (64 << 20)
+#define THREADS 4
+#define ITERATIONS 200
+
+struct Arena {
+  char *base;
+  size_t used;
+};
+
+void *arena_alloc(void *ctx, size_t size) {
+  struct Arena *arena = ctx;
+  size_t need = ((size + 15) & ~(size_t)15) + 16;
+  if (arena->used + need > ARENA_CAPACITY) return NULL;
+  char *block = arena->base + arena->used;
+  *(size_t *)block = size;
+  arena->used += need;
+  return block + 16;
+}
+
+void *arena_realloc(void *ctx, void *ptr, size_t size) {
+  if (!ptr) return arena_alloc(ctx, size);
+  size_t old_size = *(size_t *)((char *)ptr - 16);
+  if (size <= old_size) return ptr;
+  void *grown = arena_alloc(ctx, size);
+  if (grown) memcpy(grown, ptr, old_size);
+  return grown;
+}
+
+void arena_free(void *ctx, void *ptr) {
+  (void)ctx;
+  (void)ptr;
+}
+
+struct AllocatorJob {
+  const char *json;
+  unsigned char use_arena;
+};
+
+void *allocator_worker(void *arg) {
+  const struct AllocatorJob *job = arg;
+  struct Arena arena;
+  struct JsonAllocator allocator;
+  struct JsonParser parser;
+  enum JsonError error;
+  size_t i;
+  memset(&parser, 0, sizeof(parser));
+  if (job->use_arena) {
+    arena.base = malloc(ARENA_CAPACITY);
+    if (!arena.base) return NULL;
+    arena.used = 0;
+    allocator.alloc = arena_alloc;
+    allocator.realloc = arena_realloc;
+    allocator.free = arena_free;
+    allocator.ctx = &arena;
+    parser.allocator = &allocator;
+  }
+  for (i = 0; i < ITERATIONS; i++) {
+    struct JsonToken *token = jsontok_parser_parse_deep(&parser, job->json, &error);
+    jsontok_parser_free(&parser, token);
+    if (job->use_arena) arena.used = 0;
+  }
+  if (job->use_arena) free(arena.base);
+  return NULL;
+}
+
+double run_allocator_threads(const char *json, unsigned char use_arena) {
+  struct AllocatorJob job;
+  pthread_t threads[THREADS];
+  struct timespec start, end;
+  size_t i;
+  job.json = json;
+  job.use_arena = use_arena;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (i = 0; i < THREADS; i++) pthread_create(&threads[i], NULL, allocator_worker, &job);
+  for (i = 0; i < THREADS; i++) pthread_join(threads[i], NULL);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  return (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6;
+}
+
+void benchmark_allocator(const char *path) {
+  char *json = read_file(path);
+  if (json == NULL) {
+    fprintf(stderr, "Failed to get %s\n", path);
+    return;
+  }
+  double shared = run_allocator_threads(json, 0);
+  double pooled = run_allocator_threads(json, 1);
+  printf("Deep parsed %s %d times on %d threads: malloc %.1fms, per-thread arena %.1fms\n\n", path, ITERATIONS, THREADS, shared, pooled);
+  free(json);
+}
+
+#ifdef JSONTOK_ZLIB
+#define GZIP_COPIES 40
+#define GZIP_RUNS 5
+
+double elapsed_ms(const struct timespec *start) {
+  struct timespec end;
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  return (end.tv_sec - start->tv_sec) * 1e3 + (end.tv_nsec - start->tv_nsec) / 1e6;
+}
+
+void benchmark_gzip(const char *path) {
+  char *json = read_file(path);
+  if (json == NULL) {
+    fprintf(stderr, "Failed to get %s\n", path);
+    return;
+  }
+  char gzip_path[] = "/tmp/jsontok_benchmark_XXXXXX";
+  int fd = mkstemp(gzip_path);
+  gzFile file = fd >= 0 ? gzdopen(fd, "wb") : NULL;
+  size_t length = strlen(json);
+  size_t i;
+  if (file == NULL) {
+    free(json);
+    fprintf(stderr, "Failed to create %s\n", gzip_path);
+    return;
+  }
+  /* An array of copies of the sample, so there are many top-level members to overlap */
+  gzwrite(file, "[", 1);
+  for (i = 0; i < GZIP_COPIES; i++) {
+    if (i) gzwrite(file, ",", 1);
+    gzwrite(file, json, (unsigned int)length);
+  }
+  gzwrite(file, "]", 1);
+  gzclose(file);
+  free(json);
+
+  /* Decompressing and parsing are timed apart too, as overlapping them can at best take the longer of the two */
+  struct timespec start;
+  enum JsonError error;
+  size_t capacity = length * GZIP_COPIES + GZIP_COPIES + 2;
+  double decompress = 0, parse = 0, pipelined = 0;
+  struct JsonToken *token = NULL;
+  for (i = 0; i < GZIP_RUNS; i++) {
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    char *whole = malloc(capacity + 1);
+    file = gzopen(gzip_path, "rb");
+    int read = gzread(file, whole, (unsigned int)capacity);
+    gzclose(file);
+    whole[read > 0 ? read : 0] = '\0';
+    double run = elapsed_ms(&start);
+    if (!i || run < decompress) decompress = run;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    token = jsontok_parse(whole, &error);
+    jsontok_free(token);
+    free(whole);
+    run = elapsed_ms(&start);
+    if (!i || run < parse) parse = run;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    token = jsontok_parse_gzip_file(gzip_path, &error);
+    run = elapsed_ms(&start);
+    if (!i || run < pipelined) pipelined = run;
+    if (token == NULL) break;
+    jsontok_free(token);
+  }
+  unlink(gzip_path);
+  if (token == NULL) {
+    fprintf(stderr, "Failed to parse JSON: %s\n", jsontok_strerror(error));
+    return;
+  }
+  printf("Parsed %d gzipped copies of %s on %ld CPUs: decompress %.1fms, parse %.1fms, decompress then parse %.1fms, pipelined %.1fms\n\n", GZIP_COPIES, path,
+         sysconf(_SC_NPROCESSORS_ONLN), decompress, parse, decompress + parse, pipelined);
+}
+#endif
+#endif
+
 void benchmark(const char *path) {
   printf("Running %s benchmark...\n", path);
   char *json = read_file(path);
@@ -45,10 +545,23 @@ void benchmark(const char *path) {
   long elapsed = ((end - start) * 1000000) / CLOCKS_PER_SEC;
   size_t bytes = strlen(json);
   double throughput = (double)bytes / (elapsed / 1e6) / (1024 * 1024);
-  printf("Successfully parsed %s (%zu bytes) in %ldus (%.3f MB/s)\n\n", path, bytes, elapsed, throughput);
+  printf("Successfully parsed %s (%zu bytes) in %ldus (%.3f MB/s)\n", path, bytes, elapsed, throughput);
+  jsontok_free(token);
+
+  start = clock();
+  token = jsontok_parse_insitu(json, &error);
+  end = clock();
+  if (token == NULL) {
+    free(json);
+    fprintf(stderr, "Failed to parse JSON in situ: %s\n", jsontok_strerror(error));
+    return;
+  }
+  elapsed = ((end - start) * 1000000) / CLOCKS_PER_SEC;
+  throughput = (double)bytes / (elapsed / 1e6) / (1024 * 1024);
+  printf("Successfully parsed %s in situ in %ldus (%.3f MB/s)\n\n", path, elapsed, throughput);
 
-  free(json);
   jsontok_free(token);
+  free(json);
 }
 
 int main() {
@@ -59,4 +572,35 @@ int main() {
   benchmark("./samples/food.json");
   benchmark("./samples/reddit.json");
   benchmark("./samples/discord.json");
+
+  benchmark_deep("./samples/multidim_arr.json");
+  benchmark_deep("./samples/rickandmorty.json");
+  benchmark_deep("./samples/reddit.json");
+  benchmark_deep("./samples/discord.json");
+
+  benchmark_cursor("./samples/rickandmorty.json");
+  benchmark_cursor("./samples/food.json");
+  benchmark_cursor("./samples/reddit.json");
+  benchmark_cursor("./samples/discord.json");
+
+  benchmark_lazy("./samples/food.json");
+  benchmark_lazy("./samples/reddit.json");
+  benchmark_lazy("./samples/discord.json");
+  benchmark_lazy_fields(20000, 64);
+
+  benchmark_minify("./samples/food.json");
+  benchmark_minify("./samples/reddit.json");
+
+#ifdef JSONTOK_POSIX
+  benchmark_snapshot("./samples/food.json");
+  benchmark_snapshot("./samples/reddit.json");
+
+  benchmark_allocator("./samples/food.json");
+  benchmark_allocator("./samples/reddit.json");
+
+#ifdef JSONTOK_ZLIB
+  benchmark_gzip("./samples/food.json");
+  benchmark_gzip("./samples/reddit.json");
+#endif
+#endif
 }
@@ -1,14 +1,176 @@
+#if !defined(_POSIX_C_SOURCE) && (defined(__unix__) || defined(__APPLE__))
+#define _POSIX_C_SOURCE 200809L
+#endif
+
 #include "jsontok.h"
 
 #include <stdio.h>
 
+#ifdef JSONTOK_POSIX
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef JSONTOK_ZLIB
+#include <zlib.h>
+#endif
+#endif
+
+#if defined(__SSE2__) && defined(__GNUC__)
+#define JSONTOK_SSE2
+#include <emmintrin.h>
+#endif
+
+/**
+ * Usage and limits of a single parse, unlimited fields holding SIZE_MAX.
+ * When max_bytes is set, the context allocates through allocator, which
+ * counts bytes and forwards to inner.
+ */
+struct JsonBudget {
+  struct JsonAllocator allocator;
+  const struct JsonAllocator *inner;
+  size_t bytes;
+  size_t max_bytes;
+  size_t tokens;
+  size_t max_tokens;
+  size_t max_string_length;
+  size_t max_document_size;
+  unsigned char exceeded;
+};
+
+struct JsonContext {
+  unsigned char insitu;
+  unsigned int flags;
+  const struct JsonAllocator *allocator;
+  struct JsonBudget *budget;
+};
+
+struct JsonFrame {
+  struct JsonToken *token;
+  size_t capacity;
+};
+
+static struct JsonToken *jsontok_parse_root(const char *json_string, const struct JsonContext *ctx, enum JsonError *error);
 static void skip_whitespace(const char **ptr);
-static char *jsontok_parse_string(const char **json_string, enum JsonError *error);
-static double *jsontok_parse_number(const char **json_string, enum JsonError *error);
-static struct JsonObject *jsontok_parse_object(const char **json_string, enum JsonError *error);
-static struct JsonArray *jsontok_parse_array(const char **json_string, enum JsonError *error);
-static char *jsontok_parse_sub_object(const char **json_string, enum JsonError *error);
-static char *jsontok_parse_sub_array(const char **json_string, enum JsonError *error);
+static struct JsonToken *jsontok_parse_value(const char **ptr, const struct JsonContext *ctx, enum JsonError *error);
+static struct JsonToken *jsontok_parse_layers(const char *json_string, size_t max_depth, const struct JsonContext *ctx, enum JsonError *error);
+static struct JsonToken *jsontok_new_token(const struct JsonContext *ctx, enum JsonError *error);
+static struct JsonToken *jsontok_new_container(char open, const struct JsonContext *ctx, enum JsonError *error);
+static unsigned char jsontok_append(struct JsonFrame *frame, const struct JsonEntry *key, struct JsonToken *child, const struct JsonContext *ctx);
+static struct JsonToken *jsontok_abort_deep(struct JsonFrame *frames, struct JsonToken *root, const struct JsonContext *ctx);
+static char *jsontok_decode_string(const char *src, char *dst, size_t limit, const char **end, enum JsonError *error);
+static char *jsontok_parse_string(const char **json_string, size_t *length, const struct JsonContext *ctx, enum JsonError *error);
+static unsigned char jsontok_parse_key(const char **json_string, struct JsonEntry *entry, const struct JsonContext *ctx, enum JsonError *error);
+static void jsontok_release_key(const struct JsonEntry *entry, const struct JsonContext *ctx);
+static unsigned char jsontok_parse_number(const char **json_string, double *number, enum JsonError *error);
+static const char *jsontok_scan_string(const char *ptr, const char *end, unsigned char *escaped);
+static const char *jsontok_scan_number(const char *ptr, const char *end);
+static const char *jsontok_skip_container(const char *ptr, const char *end);
+static struct JsonObject *jsontok_parse_object(const char **json_string, const struct JsonContext *ctx, enum JsonError *error);
+static struct JsonArray *jsontok_parse_array(const char **json_string, const struct JsonContext *ctx, enum JsonError *error);
+static char *jsontok_parse_sub_object(const char **json_string, const struct JsonContext *ctx, enum JsonError *error);
+static char *jsontok_parse_sub_array(const char **json_string, const struct JsonContext *ctx, enum JsonError *error);
+
+static void *jsontok_default_alloc(void *ctx, size_t size) {
+  (void)ctx;
+  return malloc(size);
+}
+
+static void *jsontok_default_realloc(void *ctx, void *ptr, size_t size) {
+  (void)ctx;
+  return realloc(ptr, size);
+}
+
+static void jsontok_default_free(void *ctx, void *ptr) {
+  (void)ctx;
+  free(ptr);
+}
+
+static const struct JsonAllocator jsontok_default_allocator = {jsontok_default_alloc, jsontok_default_realloc, jsontok_default_free, NULL};
+
+static const struct JsonAllocator *jsontok_parser_allocator(const struct JsonParser *parser) {
+  return parser && parser->allocator ? parser->allocator : &jsontok_default_allocator;
+}
+
+static void *jsontok_alloc(const struct JsonAllocator *allocator, size_t size) {
+  return allocator->alloc(allocator->ctx, size);
+}
+
+static void *jsontok_realloc(const struct JsonAllocator *allocator, void *ptr, size_t size) {
+  return allocator->realloc(allocator->ctx, ptr, size);
+}
+
+static void jsontok_dealloc(const struct JsonAllocator *allocator, void *ptr) {
+  if (ptr) allocator->free(allocator->ctx, ptr);
+}
+
+static unsigned char jsontok_charge(struct JsonBudget *budget, size_t size) {
+  if (size > budget->max_bytes - budget->bytes) {
+    budget->exceeded = 1;
+    return 0;
+  }
+  budget->bytes += size;
+  return 1;
+}
+
+/* Reallocations are counted at their full new size, so with geometric growth at most twice the final size */
+static void *jsontok_limited_alloc(void *ctx, size_t size) {
+  struct JsonBudget *budget = ctx;
+  return jsontok_charge(budget, size) ? jsontok_alloc(budget->inner, size) : NULL;
+}
+
+static void *jsontok_limited_realloc(void *ctx, void *ptr, size_t size) {
+  struct JsonBudget *budget = ctx;
+  return jsontok_charge(budget, size) ? jsontok_realloc(budget->inner, ptr, size) : NULL;
+}
+
+static void jsontok_limited_free(void *ctx, void *ptr) {
+  jsontok_dealloc(((struct JsonBudget *)ctx)->inner, ptr);
+}
+
+static size_t jsontok_limit(size_t limit) {
+  return limit ? limit : (size_t)-1;
+}
+
+/* Sets up ctx for one parse of json_string, which may be NULL when the input is streamed */
+static unsigned char jsontok_begin(const struct JsonParser *parser, unsigned char insitu, const char *json_string, struct JsonContext *ctx, struct JsonBudget *budget, enum JsonError *error) {
+  ctx->insitu = insitu;
+  ctx->flags = parser ? parser->flags : 0;
+  ctx->allocator = jsontok_parser_allocator(parser);
+  ctx->budget = budget;
+  budget->inner = ctx->allocator;
+  budget->bytes = 0;
+  budget->tokens = 0;
+  budget->exceeded = 0;
+  budget->max_bytes = jsontok_limit(parser ? parser->max_bytes : 0);
+  budget->max_tokens = jsontok_limit(parser ? parser->max_tokens : 0);
+  budget->max_string_length = jsontok_limit(parser ? parser->max_string_length : 0);
+  budget->max_document_size = jsontok_limit(parser ? parser->max_document_size : 0);
+  if (parser && parser->max_bytes) {
+    budget->allocator.alloc = jsontok_limited_alloc;
+    budget->allocator.realloc = jsontok_limited_realloc;
+    budget->allocator.free = jsontok_limited_free;
+    budget->allocator.ctx = budget;
+    ctx->allocator = &budget->allocator;
+  }
+  if (json_string && parser && parser->max_document_size) {
+    /* Only looks as far as the limit, so oversized input is not read in full */
+    size_t length = 0;
+    while (length <= parser->max_document_size && json_string[length]) length++;
+    if (length > parser->max_document_size) {
+      *error = JSON_ELIMIT;
+      return 0;
+    }
+  }
+  return 1;
+}
+
+static struct JsonToken *jsontok_end(struct JsonToken *token, const struct JsonContext *ctx, enum JsonError *error) {
+  if (!token && ctx->budget->exceeded) *error = JSON_ELIMIT;
+  return token;
+}
 
 const char *jsontok_strerror(enum JsonError error) {
   switch (error) {
@@ -20,43 +182,105 @@ const char *jsontok_strerror(enum JsonError error) {
       return "Invalid type";
     case JSON_ENOMEM:
       return "Out of memory";
+    case JSON_EDEPTH:
+      return "Maximum depth exceeded";
+    case JSON_EIO:
+      return "Input/output error";
+    case JSON_ELIMIT:
+      return "Limit exceeded";
     default:
       return "Unknown error";
   }
 }
 
-void jsontok_free(struct JsonToken *token) {
-  if (token == NULL) return;
+static size_t *jsontok_child_count(struct JsonToken *token) {
+  return token->type == JSON_ARRAY ? &token->as_array->length : &token->as_object->count;
+}
+
+static struct JsonToken **jsontok_child_slot(struct JsonToken *token, size_t index) {
+  return token->type == JSON_ARRAY ? &token->as_array->elements[index] : &token->as_object->entries[index]->value;
+}
+
+static void jsontok_free_key(struct JsonToken *object, size_t index, const struct JsonAllocator *allocator) {
+  struct JsonEntry *entry = object->as_object->entries[index];
+  if (!object->insitu && !entry->lazy) jsontok_dealloc(allocator, entry->key);
+  entry->key = NULL;
+}
+
+static void jsontok_free_leaf(struct JsonToken *token, const struct JsonAllocator *allocator) {
   switch (token->type) {
-    case JSON_ARRAY: {
-      size_t i;
-      for (i = 0; i < token->as_array->length; i++) {
-        jsontok_free(token->as_array->elements[i]);
-      }
-      free(token->as_array->elements);
-      free(token->as_array);
+    case JSON_ARRAY:
+      jsontok_dealloc(allocator, token->as_array->elements);
+      jsontok_dealloc(allocator, token->as_array);
       break;
-    }
-    case JSON_OBJECT: {
-      size_t i;
-      for (i = 0; i < token->as_object->count; i++) {
-        free(token->as_object->entries[i]->key);
-        jsontok_free(token->as_object->entries[i]->value);
-        free(token->as_object->entries[i]);
-      }
-      free(token->as_object->entries);
-      free(token->as_object);
+    case JSON_OBJECT:
+      jsontok_dealloc(allocator, token->as_object->entries);
+      jsontok_dealloc(allocator, token->as_object);
+      break;
+    case JSON_STRING:
+      if (!token->insitu && !token->lazy) jsontok_dealloc(allocator, token->as_string);
       break;
-    }
     case JSON_WRAPPED_OBJECT:
     case JSON_WRAPPED_ARRAY:
-    case JSON_STRING:
-      free(token->as_string);
+      jsontok_dealloc(allocator, token->as_string);
       break;
     default:
       break;
   }
-  free(token);
+  jsontok_dealloc(allocator, token);
+}
+
+static void jsontok_free_tree(struct JsonToken *token, const struct JsonAllocator *allocator) {
+  struct JsonToken *current = token;
+  if (token == NULL) return;
+  /**
+   * Children are released last to first. Before descending into a non-empty
+   * child container, its first child is handed up to the slot it occupied in
+   * the parent and that freed slot 0 stores the parent instead, so no stack
+   * is needed however deep the tree is.
+   */
+  while (current) {
+    size_t *count = current->type == JSON_ARRAY || current->type == JSON_OBJECT ? jsontok_child_count(current) : NULL;
+    size_t floor = current != token;
+    if (!count || *count == floor) {
+      struct JsonToken *parent = NULL;
+      if (count && floor) {
+        parent = current->type == JSON_ARRAY ? current->as_array->elements[0] : (struct JsonToken *)current->as_object->entries[0];
+      }
+      jsontok_free_leaf(current, allocator);
+      current = parent;
+      continue;
+    }
+    size_t index = *count - 1;
+    struct JsonToken *child = *jsontok_child_slot(current, index);
+    if ((child->type == JSON_ARRAY || child->type == JSON_OBJECT) && *jsontok_child_count(child) > 0) {
+      *jsontok_child_slot(current, index) = *jsontok_child_slot(child, 0);
+      if (current->type == JSON_OBJECT) jsontok_free_key(current, index, allocator);
+      if (child->type == JSON_ARRAY) {
+        child->as_array->elements[0] = current;
+      } else {
+        jsontok_free_key(child, 0, allocator);
+        jsontok_dealloc(allocator, child->as_object->entries[0]);
+        child->as_object->entries[0] = (struct JsonEntry *)current;
+      }
+      current = child;
+      continue;
+    }
+    if (current->type == JSON_OBJECT) {
+      jsontok_free_key(current, index, allocator);
+      jsontok_dealloc(allocator, current->as_object->entries[index]);
+    }
+    (*count)--;
+    jsontok_free_leaf(child, allocator);
+  }
+}
+
+void jsontok_free(struct JsonToken *token) {
+  jsontok_free_tree(token, &jsontok_default_allocator);
+}
+
+void jsontok_parser_free(const struct JsonParser *parser, struct JsonToken *token) {
+  jsontok_free_tree(token, jsontok_parser_allocator(parser));
 }
 
 struct JsonToken *jsontok_get(struct JsonObject *object, const char *key) {
@@ -74,41 +298,297 @@ struct JsonToken *jsontok_get(struct JsonObject *object, const char *key) {
    */
   size_t i;
   for (i = 0; i < object->count; i++) {
-    if (strncmp(object->entries[i]->key, key, length) == 0) {
-      return object->entries[i]->value;
+    const struct JsonEntry *entry = object->entries[i];
+    /* Lazy keys are spans of the input, so they are compared by length rather than terminator */
+    if (entry->key_length == length && entry->key[0] == key[0] && !memcmp(entry->key, key, length)) {
+      return entry->value;
     }
   }
   return NULL;
 }
 
+const char *jsontok_entry_key(const struct JsonParser *parser, struct JsonEntry *entry, enum JsonError *error) {
+  if (!entry) {
+    *error = JSON_ETYPE;
+    return NULL;
+  }
+  if (!entry->lazy) return entry->key;
+  char *key = jsontok_alloc(jsontok_parser_allocator(parser), entry->key_length + 1);
+  if (!key) {
+    *error = JSON_ENOMEM;
+    return NULL;
+  }
+  memcpy(key, entry->key, entry->key_length);
+  key[entry->key_length] = '\0';
+  entry->key = key;
+  entry->lazy = 0;
+  return key;
+}
+
+const char *jsontok_as_string(const struct JsonParser *parser, struct JsonToken *token, enum JsonError *error) {
+  if (!token || token->type != JSON_STRING) {
+    *error = JSON_ETYPE;
+    return NULL;
+  }
+  if (!token->lazy) return token->as_string;
+  const char *start = token->as_raw + 1;
+  const char *end = jsontok_scan_string(token->as_raw, NULL, NULL);
+  const struct JsonAllocator *allocator = jsontok_parser_allocator(parser);
+  /* A lazy in situ string is decoded over its own source, like an eager one */
+  char *result = token->insitu ? (char *)start : jsontok_alloc(allocator, end - start + 1);
+  char *tail;
+  if (!result) {
+    *error = JSON_ENOMEM;
+    return NULL;
+  }
+  if (token->escaped) {
+    tail = jsontok_decode_string(start, result, (size_t)-1, &end, error);
+    if (!tail) {
+      if (!token->insitu) jsontok_dealloc(allocator, result);
+      return NULL;
+    }
+  } else {
+    if (result != start) memcpy(result, start, end - start);
+    tail = result + (end - start);
+  }
+  *tail = '\0';
+  token->as_string = result;
+  token->lazy = 0;
+  token->escaped = 0;
+  return result;
+}
+
+double jsontok_as_double(struct JsonToken *token, enum JsonError *error) {
+  if (!token || token->type != JSON_NUMBER) {
+    *error = JSON_ETYPE;
+    return 0;
+  }
+  if (token->integer) return (double)token->as_int64;
+  if (token->lazy) {
+    const char *raw = token->as_raw;
+    double number;
+    if (!jsontok_parse_number(&raw, &number, error)) return 0;
+    token->as_number = number;
+    token->lazy = 0;
+  }
+  return token->as_number;
+}
+
+int64_t jsontok_as_int64(struct JsonToken *token, enum JsonError *error) {
+  if (!token || token->type != JSON_NUMBER) {
+    *error = JSON_ETYPE;
+    return 0;
+  }
+  if (token->lazy) {
+    /* Integer literals are read exactly rather than through a double */
+    const char *ptr = token->as_raw;
+    unsigned char negative = *ptr == '-';
+    uint64_t limit = negative ? (uint64_t)INT64_MAX + 1 : (uint64_t)INT64_MAX;
+    uint64_t value = 0;
+    ptr += negative;
+    while (*ptr >= '0' && *ptr <= '9') {
+      unsigned int digit = *ptr++ - '0';
+      if (value > (limit - digit) / 10) {
+        *error = JSON_ETYPE;
+        return 0;
+      }
+      value = value * 10 + digit;
+    }
+    if (*ptr != '.' && *ptr != 'e' && *ptr != 'E') {
+      token->as_int64 = negative ? (int64_t)(0 - value) : (int64_t)value;
+      token->lazy = 0;
+      token->integer = 1;
+    }
+  }
+  if (token->integer) return token->as_int64;
+  double number = jsontok_as_double(token, error);
+  if (token->lazy) return 0;
+  /* The range is checked first, as converting an out of range double is undefined */
+  if (number < -9223372036854775808.0 || number >= 9223372036854775808.0 || number != (double)(int64_t)number) {
+    *error = JSON_ETYPE;
+    return 0;
+  }
+  return (int64_t)number;
+}
+
 struct JsonToken *jsontok_parse(const char *json_string, enum JsonError *error) {
-  if (!json_string || strlen(json_string) == 0) {
+  return jsontok_parser_parse(NULL, json_string, error);
+}
+
+struct JsonToken *jsontok_parse_insitu(char *json_string, enum JsonError *error) {
+  return jsontok_parser_parse_insitu(NULL, json_string, error);
+}
+
+struct JsonToken *jsontok_parse_deep(const char *json_string, size_t max_depth, enum JsonError *error) {
+  struct JsonParser parser;
+  memset(&parser, 0, sizeof(struct JsonParser));
+  parser.max_depth = max_depth;
+  return jsontok_parser_parse_deep(&parser, json_string, error);
+}
+
+struct JsonToken *jsontok_parser_parse(const struct JsonParser *parser, const char *json_string, enum JsonError *error) {
+  struct JsonContext ctx;
+  struct JsonBudget budget;
+  if (!jsontok_begin(parser, 0, json_string, &ctx, &budget, error)) return NULL;
+  return jsontok_end(jsontok_parse_root(json_string, &ctx, error), &ctx, error);
+}
+
+struct JsonToken *jsontok_parser_parse_insitu(const struct JsonParser *parser, char *json_string, enum JsonError *error) {
+  struct JsonContext ctx;
+  struct JsonBudget budget;
+  if (!jsontok_begin(parser, 1, json_string, &ctx, &budget, error)) return NULL;
+  return jsontok_end(jsontok_parse_root(json_string, &ctx, error), &ctx, error);
+}
+
+enum JsonError jsontok_parser_expand(const struct JsonParser *parser, struct JsonToken *token) {
+  struct JsonContext ctx;
+  struct JsonBudget budget;
+  enum JsonError error = JSON_ENOERR;
+  if (!token || (token->type != JSON_WRAPPED_OBJECT && token->type != JSON_WRAPPED_ARRAY)) return JSON_ETYPE;
+  if (!jsontok_begin(parser, 0, token->as_string, &ctx, &budget, &error)) return error;
+  /* The wrapped text is freed below, so nothing may be left pointing into it */
+  ctx.flags &= ~JSON_PARSE_LAZY;
+  struct JsonToken *layer = jsontok_end(jsontok_parse_root(token->as_string, &ctx, &error), &ctx, &error);
+  if (!layer) return error;
+  jsontok_dealloc(budget.inner, token->as_string);
+  if (layer->type == JSON_OBJECT) {
+    token->as_object = layer->as_object;
+  } else {
+    token->as_array = layer->as_array;
+  }
+  token->type = layer->type;
+  token->insitu = 0;
+  jsontok_dealloc(budget.inner, layer);
+  return JSON_ENOERR;
+}
+
+struct JsonToken *jsontok_parser_parse_deep(const struct JsonParser *parser, const char *json_string, enum JsonError *error) {
+  struct JsonContext ctx;
+  struct JsonBudget budget;
+  if (!jsontok_begin(parser, 0, json_string, &ctx, &budget, error)) return NULL;
+  return jsontok_end(jsontok_parse_layers(json_string, parser ? parser->max_depth : 0, &ctx, error), &ctx, error);
+}
+
+static struct JsonToken *jsontok_parse_layers(const char *json_string, size_t max_depth, const struct JsonContext *ctx, enum JsonError *error) {
+  if (!json_string) {
     *error = JSON_EFMT;
     return NULL;
   }
-  struct JsonToken *token = malloc(sizeof(struct JsonToken));
-  if (!token) {
+  const char *ptr = json_string;
+  skip_whitespace(&ptr);
+  if (*ptr != '{' && *ptr != '[') return jsontok_parse_root(json_string, ctx, error);
+  if (max_depth == 0) max_depth = JSONTOK_DEFAULT_MAX_DEPTH;
+  /* A stack that cannot be sized without overflow could never be allocated */
+  struct JsonFrame *frames = NULL;
+  if (max_depth <= SIZE_MAX / sizeof(struct JsonFrame)) frames = jsontok_alloc(ctx->allocator, max_depth * sizeof(struct JsonFrame));
+  if (!frames) {
     *error = JSON_ENOMEM;
     return NULL;
   }
+  struct JsonToken *root = jsontok_new_container(*ptr++, ctx, error);
+  if (!root) {
+    jsontok_dealloc(ctx->allocator, frames);
+    return NULL;
+  }
+  frames[0].token = root;
+  frames[0].capacity = 0;
+  size_t depth = 1;
+  while (depth > 0) {
+    struct JsonFrame *frame = &frames[depth - 1];
+    unsigned char is_array = frame->token->type == JSON_ARRAY;
+    skip_whitespace(&ptr);
+    if (*ptr == (is_array ? ']' : '}')) {
+      ptr++;
+      depth--;
+      continue;
+    }
+    if (*jsontok_child_count(frame->token) > 0) {
+      if (*ptr != ',') {
+        *error = JSON_EFMT;
+        return jsontok_abort_deep(frames, root, ctx);
+      }
+      ptr++;
+      skip_whitespace(&ptr);
+    }
+    struct JsonEntry key;
+    key.key = NULL;
+    key.lazy = 0;
+    if (!is_array) {
+      if (*ptr != '"') {
+        *error = JSON_EFMT;
+        return jsontok_abort_deep(frames, root, ctx);
+      }
+      if (!jsontok_parse_key(&ptr, &key, ctx, error)) return jsontok_abort_deep(frames, root, ctx);
+      skip_whitespace(&ptr);
+      if (*ptr != ':') {
+        jsontok_release_key(&key, ctx);
+        *error = JSON_EFMT;
+        return jsontok_abort_deep(frames, root, ctx);
+      }
+      ptr++;
+      skip_whitespace(&ptr);
+    }
+    struct JsonToken *child;
+    if (*ptr == '{' || *ptr == '[') {
+      if (depth == max_depth) {
+        jsontok_release_key(&key, ctx);
+        *error = JSON_EDEPTH;
+        return jsontok_abort_deep(frames, root, ctx);
+      }
+      child = jsontok_new_container(*ptr++, ctx, error);
+    } else {
+      child = jsontok_parse_value(&ptr, ctx, error);
+    }
+    if (!child) {
+      jsontok_release_key(&key, ctx);
+      return jsontok_abort_deep(frames, root, ctx);
+    }
+    if (!jsontok_append(frame, is_array ? NULL : &key, child, ctx)) {
+      jsontok_release_key(&key, ctx);
+      jsontok_free_tree(child, ctx->allocator);
+      *error = JSON_ENOMEM;
+      return jsontok_abort_deep(frames, root, ctx);
+    }
+    if (child->type == JSON_ARRAY || child->type == JSON_OBJECT) {
+      frames[depth].token = child;
+      frames[depth].capacity = 0;
+      depth++;
+    }
+  }
+  skip_whitespace(&ptr);
+  if (*ptr != '\0') {
+    *error = JSON_EFMT;
+    return jsontok_abort_deep(frames, root, ctx);
+  }
+  jsontok_dealloc(ctx->allocator, frames);
+  return root;
+}
+
+static struct JsonToken *jsontok_parse_root(const char *json_string, const struct JsonContext *ctx, enum JsonError *error) {
+  if (!json_string || strlen(json_string) == 0) {
+    *error = JSON_EFMT;
+    return NULL;
+  }
+  struct JsonToken *token = jsontok_new_token(ctx, error);
+  if (!token) return NULL;
   skip_whitespace(&json_string);
-  if (!memcmp(json_string, "true", 4)) {
+  if (!strncmp(json_string, "true", 4)) {
     token->type = JSON_BOOLEAN;
     token->as_boolean = 1;
     json_string += 4;
-  } else if (!memcmp(json_string, "false", 5)) {
+  } else if (!strncmp(json_string, "false", 5)) {
     token->type = JSON_BOOLEAN;
     token->as_boolean = 0;
     json_string += 5;
-  } else if (!memcmp(json_string, "null", 4)) {
+  } else if (!strncmp(json_string, "null", 4)) {
     token->type = JSON_NULL;
     json_string += 4;
   } else {
     switch (*json_string) {
       case '"': {
-        char *str = jsontok_parse_string(&json_string, error);
+        char *str = jsontok_parse_string(&json_string, NULL, ctx, error);
         if (!str) {
-          free(token);
+          jsontok_dealloc(ctx->allocator, token);
           return NULL;
         }
         token->type = JSON_STRING;
@@ -116,9 +596,9 @@ struct JsonToken *jsontok_parse(const char *json_string, enum JsonError *error)
         break;
       }
       case '{': {
-        struct JsonObject *object = jsontok_parse_object(&json_string, error);
+        struct JsonObject *object = jsontok_parse_object(&json_string, ctx, error);
         if (!object) {
-          free(token);
+          jsontok_dealloc(ctx->allocator, token);
           return NULL;
         }
         token->type = JSON_OBJECT;
@@ -126,9 +606,9 @@ struct JsonToken *jsontok_parse(const char *json_string, enum JsonError *error)
         break;
       }
       case '[': {
-        struct JsonArray *array = jsontok_parse_array(&json_string, error);
+        struct JsonArray *array = jsontok_parse_array(&json_string, ctx, error);
         if (!array) {
-          free(token);
+          jsontok_dealloc(ctx->allocator, token);
           return NULL;
         }
         token->type = JSON_ARRAY;
@@ -146,25 +626,22 @@ struct JsonToken *jsontok_parse(const char *json_string, enum JsonError *error)
       case '8':
       case '9':
       case '-': {
-        double *number = jsontok_parse_number(&json_string, error);
-        if (!number) {
-          free(token);
+        if (!jsontok_parse_number(&json_string, &token->as_number, error)) {
+          jsontok_dealloc(ctx->allocator, token);
           return NULL;
         }
         token->type = JSON_NUMBER;
-        token->as_number = *number;
-        free(number);
         break;
       }
       default:
-        free(token);
+        jsontok_dealloc(ctx->allocator, token);
         *error = JSON_EFMT;
         return NULL;
     }
   }
   skip_whitespace(&json_string);
   if (*json_string != '\0') {
-    free(token);
+    jsontok_free_tree(token, ctx->allocator);
     *error = JSON_EFMT;
     return NULL;
   }
@@ -177,29 +654,64 @@ static void skip_whitespace(const char **ptr) {
   }
 }
 
-static struct JsonToken *jsontok_parse_value(const char **ptr, enum JsonError *error) {
-  struct JsonToken *token = malloc(sizeof(struct JsonToken));
+static struct JsonToken *jsontok_new_token(const struct JsonContext *ctx, enum JsonError *error) {
+  if (++ctx->budget->tokens > ctx->budget->max_tokens) {
+    *error = JSON_ELIMIT;
+    return NULL;
+  }
+  struct JsonToken *token = jsontok_alloc(ctx->allocator, sizeof(struct JsonToken));
   if (!token) {
     *error = JSON_ENOMEM;
     return NULL;
   }
-  if (!memcmp(*ptr, "true", 4)) {
+  token->insitu = ctx->insitu;
+  token->lazy = 0;
+  token->escaped = 0;
+  token->integer = 0;
+  return token;
+}
+
+static struct JsonToken *jsontok_parse_value(const char **ptr, const struct JsonContext *ctx, enum JsonError *error) {
+  struct JsonToken *token = jsontok_new_token(ctx, error);
+  if (!token) return NULL;
+  if (ctx->flags & JSON_PARSE_LAZY && (**ptr == '"' || **ptr == '-' || (**ptr >= '0' && **ptr <= '9'))) {
+    /* Only the extent of the scalar is found here; accessors decode it later */
+    unsigned char escaped = 0;
+    const char *end = **ptr == '"' ? jsontok_scan_string(*ptr, NULL, &escaped) : jsontok_scan_number(*ptr, NULL);
+    if (!end) {
+      jsontok_dealloc(ctx->allocator, token);
+      *error = JSON_EFMT;
+      return NULL;
+    }
+    if (**ptr == '"' && (size_t)(end - *ptr - 1) > ctx->budget->max_string_length) {
+      jsontok_dealloc(ctx->allocator, token);
+      *error = JSON_ELIMIT;
+      return NULL;
+    }
+    token->type = **ptr == '"' ? JSON_STRING : JSON_NUMBER;
+    token->lazy = 1;
+    token->escaped = escaped;
+    token->as_raw = *ptr;
+    *ptr = **ptr == '"' ? end + 1 : end;
+    return token;
+  }
+  if (!strncmp(*ptr, "true", 4)) {
     token->type = JSON_BOOLEAN;
     token->as_boolean = 1;
     *ptr += 4;
-  } else if (!memcmp(*ptr, "false", 5)) {
+  } else if (!strncmp(*ptr, "false", 5)) {
     token->type = JSON_BOOLEAN;
     token->as_boolean = 0;
     *ptr += 5;
-  } else if (!memcmp(*ptr, "null", 4)) {
+  } else if (!strncmp(*ptr, "null", 4)) {
     token->type = JSON_NULL;
     *ptr += 4;
   } else {
     switch (**ptr) {
       case '"': {
-        char *str = jsontok_parse_string(ptr, error);
+        char *str = jsontok_parse_string(ptr, NULL, ctx, error);
         if (!str) {
-          free(token);
+          jsontok_dealloc(ctx->allocator, token);
           return NULL;
         }
         token->type = JSON_STRING;
@@ -207,9 +719,9 @@ static struct JsonToken *jsontok_parse_value(const char **ptr, enum JsonError *e
         break;
       }
       case '{': {
-        char *str = jsontok_parse_sub_object(ptr, error);
+        char *str = jsontok_parse_sub_object(ptr, ctx, error);
         if (!str) {
-          free(token);
+          jsontok_dealloc(ctx->allocator, token);
           return NULL;
         }
         token->type = JSON_WRAPPED_OBJECT;
@@ -217,9 +729,9 @@ static struct JsonToken *jsontok_parse_value(const char **ptr, enum JsonError *e
         break;
       }
       case '[': {
-        char *str = jsontok_parse_sub_array(ptr, error);
+        char *str = jsontok_parse_sub_array(ptr, ctx, error);
         if (!str) {
-          free(token);
+          jsontok_dealloc(ctx->allocator, token);
           return NULL;
         }
         token->type = JSON_WRAPPED_ARRAY;
@@ -237,18 +749,15 @@ static struct JsonToken *jsontok_parse_value(const char **ptr, enum JsonError *e
       case '8':
       case '9':
       case '-': {
-        double *number = jsontok_parse_number(ptr, error);
-        if (!number) {
-          free(token);
+        if (!jsontok_parse_number(ptr, &token->as_number, error)) {
+          jsontok_dealloc(ctx->allocator, token);
           return NULL;
         }
         token->type = JSON_NUMBER;
-        token->as_number = *number;
-        free(number);
         break;
       }
       default:
-        free(token);
+        jsontok_dealloc(ctx->allocator, token);
         *error = JSON_EFMT;
         return NULL;
     }
@@ -256,28 +765,44 @@ static struct JsonToken *jsontok_parse_value(const char **ptr, enum JsonError *e
   return token;
 }
 
-static char *jsontok_parse_string(const char **json_string, enum JsonError *error) {
-  const char *start = *json_string;
-  char *result = NULL;
-  size_t length = 0;
-  if (*start != '"') {
-    *error = JSON_EFMT;
-    return NULL;
-  }
-  start++;
-  while (*start != '"') {
-    if (*start == '\0') {
+/**
+ * Decodes the string body at src into dst, stopping with JSON_ELIMIT once
+ * more than limit raw bytes would be consumed.
+ */
+static char *jsontok_decode_string(const char *src, char *dst, size_t limit, const char **end, enum JsonError *error) {
+  const char *begin = src;
+  while (1) {
+    const char *run = src;
+    while (*src != '"' && *src != '\\' && *src != '\0' && (size_t)(src - begin) <= limit) src++;
+    if ((size_t)(src - begin) > limit) {
+      *error = JSON_ELIMIT;
+      return NULL;
+    }
+    if (src != run) {
+      /* Unescaped runs are moved in bulk; in situ they may already be in place */
+      if (dst != run) memmove(dst, run, src - run);
+      dst += src - run;
+    }
+    if (*src == '"') break;
+    if (*src == '\0') {
       *error = JSON_EFMT;
       return NULL;
     }
-    if (*start == '\\') {
-      start++;
-      if (*start == 'u') {
-        start++;
+    src++;
+    switch (*src++) {
+      case 'b': *dst++ = '\b'; break;
+      case 'f': *dst++ = '\f'; break;
+      case 'n': *dst++ = '\n'; break;
+      case 'r': *dst++ = '\r'; break;
+      case 't': *dst++ = '\t'; break;
+      case '"': *dst++ = '"'; break;
+      case '/': *dst++ = '/'; break;
+      case '\\': *dst++ = '\\'; break;
+      case 'u': {
         unsigned int unicode_value = 0;
         size_t i = 0;
         for (; i < 4; i++) {
-          char hex_digit = *start++;
+          char hex_digit = *src++;
           unicode_value <<= 4;
           if (hex_digit >= '0' && hex_digit <= '9') {
             unicode_value += hex_digit - '0';
@@ -291,209 +816,260 @@ static char *jsontok_parse_string(const char **json_string, enum JsonError *erro
           }
         }
         if (unicode_value <= 0x7F) {
-          result = realloc(result, length + 1);
-          result[length++] = (char)unicode_value;
+          *dst++ = (char)unicode_value;
         } else if (unicode_value <= 0x7FF) {
-          result = realloc(result, length + 2);
-          result[length++] = 0xC0 | ((unicode_value >> 6) & 0x1F);
-          result[length++] = 0x80 | (unicode_value & 0x3F);
-        } else if (unicode_value <= 0xFFFF) {
-          result = realloc(result, length + 3);
-          result[length++] = 0xE0 | ((unicode_value >> 12) & 0x0F);
-          result[length++] = 0x80 | ((unicode_value >> 6) & 0x3F);
-          result[length++] = 0x80 | (unicode_value & 0x3F);
-        } else if (unicode_value <= 0x10FFFF) {
-          result = realloc(result, length + 4);
-          result[length++] = 0xF0 | ((unicode_value >> 18) & 0x07);
-          result[length++] = 0x80 | ((unicode_value >> 12) & 0x3F);
-          result[length++] = 0x80 | ((unicode_value >> 6) & 0x3F);
-          result[length++] = 0x80 | (unicode_value & 0x3F);
-        }
-      } else {
-        switch (*start) {
-          case 'b':
-            result = realloc(result, length + 1);
-            result[length++] = '\b';
-            break;
-          case 'f':
-            result = realloc(result, length + 1);
-            result[length++] = '\f';
-            break;
-          case 'n':
-            result = realloc(result, length + 1);
-            result[length++] = '\n';
-            break;
-          case 'r':
-            result = realloc(result, length + 1);
-            result[length++] = '\r';
-            break;
-          case 't':
-            result = realloc(result, length + 1);
-            result[length++] = '\t';
-            break;
-          case '"':
-            result = realloc(result, length + 1);
-            result[length++] = '"';
-            break;
-          case '\\':
-            result = realloc(result, length + 1);
-            result[length++] = '\\';
-            break;
-          default:
-            *error = JSON_EFMT;
-            return NULL;
+          *dst++ = 0xC0 | ((unicode_value >> 6) & 0x1F);
+          *dst++ = 0x80 | (unicode_value & 0x3F);
+        } else {
+          *dst++ = 0xE0 | ((unicode_value >> 12) & 0x0F);
+          *dst++ = 0x80 | ((unicode_value >> 6) & 0x3F);
+          *dst++ = 0x80 | (unicode_value & 0x3F);
         }
-        start++;
+        break;
       }
-    } else {
-      result = realloc(result, length + 1);
-      result[length++] = *start++;
+      default:
+        *error = JSON_EFMT;
+        return NULL;
     }
   }
-  result = realloc(result, length + 1);
-  result[length] = '\0';
-  *json_string = start + 1;
+  *end = src + 1;
+  return dst;
+}
+
+static char *jsontok_parse_string(const char **json_string, size_t *length, const struct JsonContext *ctx, enum JsonError *error) {
+  const char *start = *json_string;
+  if (*start != '"') {
+    *error = JSON_EFMT;
+    return NULL;
+  }
+  start++;
+  if (ctx->insitu) {
+    /* Decoded output never outgrows its source, so it can be written over it */
+    char *result = (char *)start;
+    char *tail = jsontok_decode_string(start, result, ctx->budget->max_string_length, json_string, error);
+    if (!tail) return NULL;
+    *tail = '\0';
+    if (length) *length = tail - result;
+    return result;
+  }
+  /* Escapes only shrink, so the raw length is an upper bound of the decoded one */
+  const char *scan = jsontok_scan_string(start - 1, NULL, NULL);
+  if (!scan) {
+    *error = JSON_EFMT;
+    return NULL;
+  }
+  if ((size_t)(scan - start) > ctx->budget->max_string_length) {
+    *error = JSON_ELIMIT;
+    return NULL;
+  }
+  char *result = jsontok_alloc(ctx->allocator, scan - start + 1);
+  if (!result) {
+    *error = JSON_ENOMEM;
+    return NULL;
+  }
+  char *tail = jsontok_decode_string(start, result, (size_t)-1, json_string, error);
+  if (!tail) {
+    jsontok_dealloc(ctx->allocator, result);
+    return NULL;
+  }
+  *tail = '\0';
+  if (length) *length = tail - result;
   return result;
 }
 
-static double *jsontok_parse_number(const char **json_string, enum JsonError *error) {
-  char *ptr = (char *)(*json_string + 1);
-  unsigned char needs_digit = **json_string == '-';
-  unsigned char decimal = 1;
-  while (1) {
-    char c = *ptr++;
-    if (c >= '0' && c <= '9') continue;
-    if (needs_digit) {
+/**
+ * Parses the key at *json_string into entry. With JSON_PARSE_LAZY, a key
+ * without escapes outside in situ parsing stays a span of the input that
+ * jsontok_get compares as it is; jsontok_entry_key copies it out on demand.
+ */
+static unsigned char jsontok_parse_key(const char **json_string, struct JsonEntry *entry, const struct JsonContext *ctx, enum JsonError *error) {
+  entry->lazy = 0;
+  if (ctx->flags & JSON_PARSE_LAZY && !ctx->insitu) {
+    unsigned char escaped = 0;
+    const char *end = jsontok_scan_string(*json_string, NULL, &escaped);
+    if (!end) {
       *error = JSON_EFMT;
-      return NULL;
+      return 0;
     }
-    if (decimal && c == '.') {
-      decimal = 0;
-      continue;
+    if (!escaped) {
+      if ((size_t)(end - *json_string - 1) > ctx->budget->max_string_length) {
+        *error = JSON_ELIMIT;
+        return 0;
+      }
+      entry->key = (char *)*json_string + 1;
+      entry->key_length = end - *json_string - 1;
+      entry->lazy = 1;
+      *json_string = end + 1;
+      return 1;
     }
-    break;
-  }
-  ptr--;
-  size_t length = ptr - *json_string;
-  char *substr = malloc(length + 1);
-  if (!substr) {
-    *error = JSON_ENOMEM;
-    return NULL;
   }
-  strncpy(substr, *json_string, length);
-  substr[length] = '\0';
-  errno = 0;
+  entry->key = jsontok_parse_string(json_string, &entry->key_length, ctx, error);
+  return entry->key != NULL;
+}
+
+static void jsontok_release_key(const struct JsonEntry *entry, const struct JsonContext *ctx) {
+  if (!ctx->insitu && !entry->lazy) jsontok_dealloc(ctx->allocator, entry->key);
+}
+
+/**
+ * Converts the NUL-terminated number text from start to end, which
+ * jsontok_scan_number has accepted. Literals too small for a double round
+ * like any other inexact one; only those too large for it are rejected.
+ */
+static unsigned char jsontok_strtod(const char *start, const char *end, double *number) {
   char *endptr = NULL;
-  double *number = malloc(sizeof(double));
-  if (!number) {
-    free(substr);
-    return NULL;
+  errno = 0;
+  *number = strtod(start, &endptr);
+  /* Overflow gives +-HUGE_VAL and underflow a value below DBL_MIN; this test holds under -ffast-math too */
+  return endptr == end && !(errno == ERANGE && (*number > 1 || *number < -1));
+}
+
+static unsigned char jsontok_parse_number(const char **json_string, double *number, enum JsonError *error) {
+  const char *end = jsontok_scan_number(*json_string, NULL);
+  if (!end) {
+    *error = JSON_EFMT;
+    return 0;
   }
-  *number = strtod(substr, &endptr);
-  if (errno || *endptr != '\0') {
+  if (!jsontok_strtod(*json_string, end, number)) {
     *error = JSON_EFMT;
-    free(number);
-    free(substr);
-    return NULL;
+    return 0;
   }
-  free(substr);
-  *json_string = ptr;
-  return number;
+  *json_string = end;
+  return 1;
+}
+
+static struct JsonToken *jsontok_new_container(char open, const struct JsonContext *ctx, enum JsonError *error) {
+  struct JsonToken *token = jsontok_new_token(ctx, error);
+  if (!token) return NULL;
+  token->insitu = 0;
+  if (open == '[') {
+    token->type = JSON_ARRAY;
+    token->as_array = jsontok_alloc(ctx->allocator, sizeof(struct JsonArray));
+    if (!token->as_array) {
+      jsontok_dealloc(ctx->allocator, token);
+      *error = JSON_ENOMEM;
+      return NULL;
+    }
+    token->as_array->length = 0;
+    token->as_array->elements = NULL;
+  } else {
+    token->type = JSON_OBJECT;
+    token->as_object = jsontok_alloc(ctx->allocator, sizeof(struct JsonObject));
+    if (!token->as_object) {
+      jsontok_dealloc(ctx->allocator, token);
+      *error = JSON_ENOMEM;
+      return NULL;
+    }
+    token->as_object->count = 0;
+    token->as_object->entries = NULL;
+  }
+  return token;
+}
+
+static unsigned char jsontok_append(struct JsonFrame *frame, const struct JsonEntry *key, struct JsonToken *child, const struct JsonContext *ctx) {
+  size_t *count = jsontok_child_count(frame->token);
+  if (*count == frame->capacity) {
+    size_t capacity = frame->capacity ? frame->capacity * 2 : 8;
+    if (frame->token->type == JSON_ARRAY) {
+      struct JsonToken **elements = jsontok_realloc(ctx->allocator, frame->token->as_array->elements, capacity * sizeof(struct JsonToken *));
+      if (!elements) return 0;
+      frame->token->as_array->elements = elements;
+    } else {
+      struct JsonEntry **entries = jsontok_realloc(ctx->allocator, frame->token->as_object->entries, capacity * sizeof(struct JsonEntry *));
+      if (!entries) return 0;
+      frame->token->as_object->entries = entries;
+    }
+    frame->capacity = capacity;
+  }
+  if (frame->token->type == JSON_ARRAY) {
+    frame->token->as_array->elements[(*count)++] = child;
+  } else {
+    struct JsonEntry *entry = jsontok_alloc(ctx->allocator, sizeof(struct JsonEntry));
+    if (!entry) return 0;
+    *entry = *key;
+    entry->value = child;
+    frame->token->as_object->entries[(*count)++] = entry;
+  }
+  return 1;
+}
+
+static struct JsonToken *jsontok_abort_deep(struct JsonFrame *frames, struct JsonToken *root, const struct JsonContext *ctx) {
+  jsontok_dealloc(ctx->allocator, frames);
+  jsontok_free_tree(root, ctx->allocator);
+  return NULL;
+}
+
+static void jsontok_free_partial_object(struct JsonObject *object, const struct JsonContext *ctx) {
+  size_t i = 0;
+  for (; i < object->count; i++) {
+    jsontok_release_key(object->entries[i], ctx);
+    jsontok_free_tree(object->entries[i]->value, ctx->allocator);
+    jsontok_dealloc(ctx->allocator, object->entries[i]);
+  }
+  jsontok_dealloc(ctx->allocator, object->entries);
+  jsontok_dealloc(ctx->allocator, object);
 }
 
-static struct JsonObject *jsontok_parse_object(const char **json_string, enum JsonError *error) {
-  struct JsonObject *object = malloc(sizeof(struct JsonObject));
+static struct JsonObject *jsontok_parse_object(const char **json_string, const struct JsonContext *ctx, enum JsonError *error) {
+  struct JsonObject *object = jsontok_alloc(ctx->allocator, sizeof(struct JsonObject));
   if (!object) {
     *error = JSON_ENOMEM;
     return NULL;
   }
   object->count = 0;
   object->entries = NULL;
+  size_t capacity = 0;
   const char *ptr = (char *)(*json_string + 1);
   while (*ptr != '}') {
     skip_whitespace(&ptr);
     if (*ptr != '"') {
-      size_t i = 0;
-      for (; i < object->count; i++) {
-        free(object->entries[i]->key);
-        jsontok_free(object->entries[i]->value);
-      }
-      free(object->entries);
-      free(object);
+      jsontok_free_partial_object(object, ctx);
       *error = JSON_EFMT;
       return NULL;
     }
-    char *key = jsontok_parse_string((const char **)&ptr, error);
-    if (!key) {
-      size_t i = 0;
-      for (; i < object->count; i++) {
-        free(object->entries[i]->key);
-        jsontok_free(object->entries[i]->value);
-      }
-      free(object->entries);
-      free(object);
-      *error = JSON_ENOMEM;
+    struct JsonEntry key;
+    if (!jsontok_parse_key(&ptr, &key, ctx, error)) {
+      jsontok_free_partial_object(object, ctx);
       return NULL;
     }
     skip_whitespace(&ptr);
     if (*ptr != ':') {
-      size_t i = 0;
-      for (; i < object->count; i++) {
-        free(object->entries[i]->key);
-        jsontok_free(object->entries[i]->value);
-      }
-      free(object->entries);
-      free(object);
-      free(key);
+      jsontok_free_partial_object(object, ctx);
+      jsontok_release_key(&key, ctx);
       *error = JSON_EFMT;
       return NULL;
     }
     ptr++;
     skip_whitespace(&ptr);
-    struct JsonToken *token = jsontok_parse_value((const char **)&ptr, error);
+    struct JsonToken *token = jsontok_parse_value((const char **)&ptr, ctx, error);
     if (!token) {
-      size_t i = 0;
-      for (; i < object->count; i++) {
-        free(object->entries[i]->key);
-        jsontok_free(object->entries[i]->value);
-      }
-      free(object->entries);
-      free(object);
-      free(key);
+      jsontok_free_partial_object(object, ctx);
+      jsontok_release_key(&key, ctx);
       return NULL;
     }
-    struct JsonEntry *entry = malloc(sizeof(struct JsonEntry));
+    struct JsonEntry *entry = jsontok_alloc(ctx->allocator, sizeof(struct JsonEntry));
     if (!entry) {
-      size_t i = 0;
-      for (; i < object->count; i++) {
-        free(object->entries[i]->key);
-        jsontok_free(object->entries[i]->value);
-      }
-      free(object->entries);
-      free(object);
-      free(key);
-      jsontok_free(token);
+      jsontok_free_partial_object(object, ctx);
+      jsontok_release_key(&key, ctx);
+      jsontok_free_tree(token, ctx->allocator);
       *error = JSON_ENOMEM;
       return NULL;
     }
-    entry->key = key;
+    *entry = key;
     entry->value = token;
-    struct JsonEntry **new_entries = realloc(object->entries, (object->count + 1) * sizeof(struct JsonEntry *));
-    if (!new_entries) {
-      size_t i = 0;
-      for (; i < object->count; i++) {
-        free(object->entries[i]->key);
-        jsontok_free(object->entries[i]->value);
-      }
-      free(object->entries);
-      free(object);
-      free(key);
-      jsontok_free(token);
-      free(entry);
-      *error = JSON_ENOMEM;
-      return NULL;
+    if (object->count == capacity) {
+      capacity = capacity ? capacity * 2 : 8;
+      struct JsonEntry **new_entries = jsontok_realloc(ctx->allocator, object->entries, capacity * sizeof(struct JsonEntry *));
+      if (!new_entries) {
+        jsontok_free_partial_object(object, ctx);
+        jsontok_release_key(&key, ctx);
+        jsontok_free_tree(token, ctx->allocator);
+        jsontok_dealloc(ctx->allocator, entry);
+        *error = JSON_ENOMEM;
+        return NULL;
+      }
+      object->entries = new_entries;
     }
-    object->entries = new_entries;
     object->entries[object->count++] = entry;
     skip_whitespace(&ptr);
     if (*ptr == ',') ptr++;
@@ -503,43 +1079,48 @@ static struct JsonObject *jsontok_parse_object(const char **json_string, enum Js
   return object;
 }
 
-static struct JsonArray *jsontok_parse_array(const char **json_string, enum JsonError *error) {
-  struct JsonArray *array = malloc(sizeof(struct JsonArray));
+static struct JsonArray *jsontok_parse_array(const char **json_string, const struct JsonContext *ctx, enum JsonError *error) {
+  struct JsonArray *array = jsontok_alloc(ctx->allocator, sizeof(struct JsonArray));
   if (!array) {
     *error = JSON_ENOMEM;
     return NULL;
   }
   array->length = 0;
   array->elements = NULL;
+  size_t capacity = 0;
   const char *ptr = *json_string + 1;
   while (*ptr != ']') {
     skip_whitespace(&ptr);
     if (*ptr == '\0') {
       size_t i = 0;
-      for (; i < array->length; i++) jsontok_free(array->elements[i]);
-      free(array->elements);
-      free(array);
+      for (; i < array->length; i++) jsontok_free_tree(array->elements[i], ctx->allocator);
+      jsontok_dealloc(ctx->allocator, array->elements);
+      jsontok_dealloc(ctx->allocator, array);
       *error = JSON_EFMT;
       return NULL;
     }
-    struct JsonToken *token = jsontok_parse_value((const char **)&ptr, error);
+    struct JsonToken *token = jsontok_parse_value((const char **)&ptr, ctx, error);
     if (!token) {
       size_t i = 0;
-      for (; i < array->length; i++) jsontok_free(array->elements[i]);
-      free(array->elements);
-      free(array);
+      for (; i < array->length; i++) jsontok_free_tree(array->elements[i], ctx->allocator);
+      jsontok_dealloc(ctx->allocator, array->elements);
+      jsontok_dealloc(ctx->allocator, array);
       return NULL;
     }
-    void *new_elements = realloc(array->elements, (array->length + 1) * sizeof(struct JsonToken));
-    if (!new_elements) {
-      size_t i = 0;
-      for (; i < array->length; i++) jsontok_free(array->elements[i]);
-      free(array->elements);
-      free(array);
-      *error = JSON_ENOMEM;
-      return NULL;
+    if (array->length == capacity) {
+      capacity = capacity ? capacity * 2 : 8;
+      struct JsonToken **new_elements = jsontok_realloc(ctx->allocator, array->elements, capacity * sizeof(struct JsonToken *));
+      if (!new_elements) {
+        size_t i = 0;
+        for (; i < array->length; i++) jsontok_free_tree(array->elements[i], ctx->allocator);
+        jsontok_free_tree(token, ctx->allocator);
+        jsontok_dealloc(ctx->allocator, array->elements);
+        jsontok_dealloc(ctx->allocator, array);
+        *error = JSON_ENOMEM;
+        return NULL;
+      }
+      array->elements = new_elements;
     }
-    array->elements = new_elements;
     array->elements[array->length++] = token;
     skip_whitespace(&ptr);
     if (*ptr == ',') ptr++;
@@ -549,54 +1130,1371 @@ static struct JsonArray *jsontok_parse_array(const char **json_string, enum Json
   return array;
 }
 
-static char *jsontok_parse_sub_object(const char **json_string, enum JsonError *error) {
-  char *ptr = (char *)(*json_string + 1);
-  size_t counter = 1;
-  while (counter > 1 || *ptr != '}') {
-    if (*ptr == '\0') {
-      *error = JSON_EFMT;
-      return NULL;
-    }
-    if (*ptr == '{')
-      counter++;
-    else if (*ptr == '}')
-      counter--;
-    ptr += (*ptr == '\\') + 1;
-  }
-  size_t length = ptr - *json_string + 1;
-  char *substr = malloc(length + 1);
+/* Copies the container text from start to end, which is already known to be complete */
+static char *jsontok_wrap_span(const char *start, const char *end, const struct JsonContext *ctx, enum JsonError *error) {
+  size_t length = end - start;
+  char *substr = jsontok_alloc(ctx->allocator, length + 1);
   if (!substr) {
     *error = JSON_ENOMEM;
     return NULL;
   }
-  strncpy(substr, *json_string, length);
+  if (ctx->flags & JSON_PARSE_MINIFY) {
+    length = jsontok_minify(start, length, substr);
+  } else {
+    memcpy(substr, start, length);
+  }
   substr[length] = '\0';
-  *json_string = ptr + 1;
   return substr;
 }
 
-static char *jsontok_parse_sub_array(const char **json_string, enum JsonError *error) {
-  char *ptr = (char *)(*json_string + 1);
-  size_t counter = 1;
-  while (counter > 1 || *ptr != ']') {
-    if (*ptr == '\0') {
-      *error = JSON_EFMT;
-      return NULL;
+static char *jsontok_parse_sub_object(const char **json_string, const struct JsonContext *ctx, enum JsonError *error) {
+  const char *end = jsontok_skip_container(*json_string, NULL);
+  if (!end) {
+    *error = JSON_EFMT;
+    return NULL;
+  }
+  char *substr = jsontok_wrap_span(*json_string, end, ctx, error);
+  if (substr) *json_string = end;
+  return substr;
+}
+
+static char *jsontok_parse_sub_array(const char **json_string, const struct JsonContext *ctx, enum JsonError *error) {
+  return jsontok_parse_sub_object(json_string, ctx, error);
+}
+
+size_t jsontok_minify(const char *buf, size_t len, char *out) {
+  const char *end = buf + len;
+  char *dst = out;
+  unsigned char in_string = 0;
+  while (buf != end) {
+    const char *stop = end;
+#ifdef JSONTOK_SSE2
+    /**
+     * Blocks without backslashes are compacted from their masks. A prefix XOR
+     * of the quote bits gives the bytes inside strings, and the whitespace
+     * outside them is dropped. Output never passes the input being read, so
+     * this also works in place.
+     */
+    while (end - buf >= 16) {
+      __m128i block = _mm_loadu_si128((const __m128i *)buf);
+      if (_mm_movemask_epi8(_mm_cmpeq_epi8(block, _mm_set1_epi8('\\')))) break;
+      unsigned int inside = _mm_movemask_epi8(_mm_cmpeq_epi8(block, _mm_set1_epi8('"')));
+      __m128i space = _mm_or_si128(_mm_cmpeq_epi8(block, _mm_set1_epi8(' ')), _mm_cmpeq_epi8(block, _mm_set1_epi8('\n')));
+      space = _mm_or_si128(space, _mm_or_si128(_mm_cmpeq_epi8(block, _mm_set1_epi8('\t')), _mm_cmpeq_epi8(block, _mm_set1_epi8('\r'))));
+      inside ^= inside << 1;
+      inside ^= inside << 2;
+      inside ^= inside << 4;
+      inside ^= inside << 8;
+      if (in_string) inside = ~inside;
+      inside &= 0xFFFF;
+      in_string = inside >> 15;
+      unsigned int keep = ~((unsigned int)_mm_movemask_epi8(space) & ~inside) & 0xFFFF;
+      if (keep == 0xFFFF) {
+        _mm_storeu_si128((__m128i *)dst, block);
+        dst += 16;
+      } else {
+        for (; keep; keep &= keep - 1) *dst++ = buf[__builtin_ctz(keep)];
+      }
+      buf += 16;
+    }
+    /* A block holding a backslash goes through the byte loop */
+    if (end - buf >= 16) stop = buf + 16;
+#endif
+    while (buf < stop) {
+      char c = *buf++;
+      if (in_string) {
+        *dst++ = c;
+        if (c == '"') {
+          in_string = 0;
+        } else if (c == '\\' && buf != end) {
+          *dst++ = *buf++;
+        }
+      } else if (c != ' ' && c != '\n' && c != '\t' && c != '\r') {
+        *dst++ = c;
+        in_string = c == '"';
+      }
     }
-    if (*ptr == '[')
-      counter++;
-    else if (*ptr == ']')
-      counter--;
-    ptr += (*ptr == '\\') + 1;
   }
-  size_t length = ptr - *json_string + 1;
-  char *substr = malloc(length + 1);
-  if (!substr) {
+  return dst - out;
+}
+
+static unsigned char jsontok_is_digit(const char *ptr, const char *end) {
+  return ptr != end && *ptr >= '0' && *ptr <= '9';
+}
+
+static const char *jsontok_scan_string(const char *ptr, const char *end, unsigned char *escaped) {
+  ptr++;
+  while (ptr != end && *ptr != '"') {
+    if (*ptr == '\0') return NULL;
+    if (*ptr == '\\') {
+      if (++ptr == end || *ptr == '\0') return NULL;
+      if (escaped) *escaped = 1;
+    }
+    ptr++;
+  }
+  return ptr == end ? NULL : ptr;
+}
+
+static const char *jsontok_scan_number(const char *ptr, const char *end) {
+  if (ptr != end && *ptr == '-') ptr++;
+  if (!jsontok_is_digit(ptr, end)) return NULL;
+  if (*ptr == '0') {
+    ptr++;
+  } else {
+    while (jsontok_is_digit(ptr, end)) ptr++;
+  }
+  if (ptr != end && *ptr == '.') {
+    ptr++;
+    if (!jsontok_is_digit(ptr, end)) return NULL;
+    while (jsontok_is_digit(ptr, end)) ptr++;
+  }
+  if (ptr != end && (*ptr == 'e' || *ptr == 'E')) {
+    ptr++;
+    if (ptr != end && (*ptr == '+' || *ptr == '-')) ptr++;
+    if (!jsontok_is_digit(ptr, end)) return NULL;
+    while (jsontok_is_digit(ptr, end)) ptr++;
+  }
+  return ptr;
+}
+
+/**
+ * Finds the end of the container at ptr, rejecting closers that do not match
+ * their opener. Openers are only recorded for the first
+ * JSONTOK_DEFAULT_MAX_DEPTH levels; deeper layers are checked once skipped
+ * again from a shallower start, when they are expanded or entered.
+ */
+static const char *jsontok_skip_container(const char *ptr, const char *end) {
+  unsigned char in_object[JSONTOK_DEFAULT_MAX_DEPTH / 8];
+  size_t depth = 0;
+  /* Strings are stepped over whole so brackets inside them are not counted */
+  for (; ptr != end && *ptr != '\0'; ptr++) {
+    switch (*ptr) {
+      case '"':
+        ptr = jsontok_scan_string(ptr, end, NULL);
+        if (!ptr) return NULL;
+        break;
+      case '{':
+      case '[':
+        if (depth < JSONTOK_DEFAULT_MAX_DEPTH) {
+          if (*ptr == '{') {
+            in_object[depth / 8] |= 1 << (depth % 8);
+          } else {
+            in_object[depth / 8] &= ~(1 << (depth % 8));
+          }
+        }
+        depth++;
+        break;
+      case '}':
+      case ']':
+        if (--depth < JSONTOK_DEFAULT_MAX_DEPTH && (in_object[depth / 8] >> (depth % 8) & 1) != (*ptr == '}')) return NULL;
+        if (depth == 0) return ptr + 1;
+        break;
+      default:
+        break;
+    }
+  }
+  return NULL;
+}
+
+static const char *skip_whitespace_bounded(const char *ptr, const char *end) {
+  while (ptr != end && (*ptr == '\t' || *ptr == '\r' || *ptr == '\n' || *ptr == ' ')) ptr++;
+  return ptr;
+}
+
+static const char *jsontok_scan_literal(const char *ptr, const char *end, const char *literal, size_t length) {
+  if ((size_t)(end - ptr) < length || strncmp(ptr, literal, length)) return NULL;
+  return ptr + length;
+}
+
+static const char *jsontok_scan_number_bounded(const char *ptr, const char *end, double *number) {
+  const char *number_end = jsontok_scan_number(ptr, end);
+  char copy[64];
+  if (!number_end || (size_t)(number_end - ptr) >= sizeof(copy)) return NULL;
+  size_t length = number_end - ptr;
+  /* strtod may read past the number, for example over "0x", so it is only given a terminated copy */
+  memcpy(copy, ptr, length);
+  copy[length] = '\0';
+  return jsontok_strtod(copy, copy + length, number) ? number_end : NULL;
+}
+
+static const char *jsontok_skip_value(const char *ptr, const char *end) {
+  if (ptr == end) return NULL;
+  switch (*ptr) {
+    case '{':
+    case '[':
+      return jsontok_skip_container(ptr, end);
+    case '"':
+      ptr = jsontok_scan_string(ptr, end, NULL);
+      return ptr ? ptr + 1 : NULL;
+    case 't':
+      return jsontok_scan_literal(ptr, end, "true", 4);
+    case 'f':
+      return jsontok_scan_literal(ptr, end, "false", 5);
+    case 'n':
+      return jsontok_scan_literal(ptr, end, "null", 4);
+    default:
+      return jsontok_scan_number(ptr, end);
+  }
+}
+
+struct JsonCursor jsontok_cursor_init(const char *buf, size_t len) {
+  struct JsonCursor cursor;
+  cursor.ptr = buf;
+  cursor.end = buf + len;
+  cursor.opened = NULL;
+  cursor.depth = 0;
+  cursor.state = JSON_CURSOR_VALUE;
+  cursor.error = JSON_ENOERR;
+  if (!buf) {
+    cursor.state = JSON_CURSOR_DONE;
+    cursor.error = JSON_EFMT;
+  } else {
+    cursor.ptr = skip_whitespace_bounded(cursor.ptr, cursor.end);
+  }
+  return cursor;
+}
+
+static unsigned char jsontok_cursor_fail(struct JsonCursor *cursor, enum JsonError error) {
+  cursor->state = JSON_CURSOR_DONE;
+  cursor->error = error;
+  return 0;
+}
+
+unsigned char jsontok_cursor_next(struct JsonCursor *cursor, struct JsonEvent *event) {
+  const char *end = cursor->end;
+  cursor->opened = NULL;
+  while (1) {
+    const char *ptr = cursor->ptr;
+    if (cursor->state == JSON_CURSOR_DONE) return 0;
+    if (cursor->state == JSON_CURSOR_AFTER_VALUE) {
+      ptr = skip_whitespace_bounded(ptr, end);
+      cursor->ptr = ptr;
+      if (cursor->depth == 0) {
+        if (ptr != end) return jsontok_cursor_fail(cursor, JSON_EFMT);
+        cursor->state = JSON_CURSOR_DONE;
+        return 0;
+      }
+      if (ptr == end) return jsontok_cursor_fail(cursor, JSON_EFMT);
+      unsigned char object = cursor->in_object[(cursor->depth - 1) / 8] >> ((cursor->depth - 1) % 8) & 1;
+      if (*ptr == ',') {
+        cursor->ptr = skip_whitespace_bounded(ptr + 1, end);
+        cursor->state = object ? JSON_CURSOR_KEY : JSON_CURSOR_VALUE;
+        continue;
+      }
+      if (*ptr != (object ? '}' : ']')) return jsontok_cursor_fail(cursor, JSON_EFMT);
+      cursor->ptr = ptr + 1;
+      cursor->depth--;
+      event->type = object ? JSON_EVENT_END_OBJECT : JSON_EVENT_END_ARRAY;
+      return 1;
+    }
+    if (cursor->state == JSON_CURSOR_KEY) {
+      const char *key_end = ptr != end && *ptr == '"' ? jsontok_scan_string(ptr, end, NULL) : NULL;
+      if (!key_end) return jsontok_cursor_fail(cursor, JSON_EFMT);
+      event->type = JSON_EVENT_KEY;
+      event->string = ptr + 1;
+      event->length = key_end - ptr - 1;
+      ptr = skip_whitespace_bounded(key_end + 1, end);
+      if (ptr == end || *ptr != ':') return jsontok_cursor_fail(cursor, JSON_EFMT);
+      cursor->ptr = skip_whitespace_bounded(ptr + 1, end);
+      cursor->state = JSON_CURSOR_VALUE;
+      return 1;
+    }
+    if (ptr == end) return jsontok_cursor_fail(cursor, JSON_EFMT);
+    cursor->state = JSON_CURSOR_AFTER_VALUE;
+    switch (*ptr) {
+      case '{':
+      case '[': {
+        unsigned char object = *ptr == '{';
+        size_t depth = cursor->depth;
+        if (depth == JSONTOK_DEFAULT_MAX_DEPTH) return jsontok_cursor_fail(cursor, JSON_EDEPTH);
+        if (object) {
+          cursor->in_object[depth / 8] |= 1 << (depth % 8);
+        } else {
+          cursor->in_object[depth / 8] &= ~(1 << (depth % 8));
+        }
+        cursor->depth++;
+        cursor->opened = ptr;
+        cursor->ptr = skip_whitespace_bounded(ptr + 1, end);
+        if (cursor->ptr == end || *cursor->ptr != (object ? '}' : ']')) {
+          cursor->state = object ? JSON_CURSOR_KEY : JSON_CURSOR_VALUE;
+        }
+        event->type = object ? JSON_EVENT_START_OBJECT : JSON_EVENT_START_ARRAY;
+        return 1;
+      }
+      case '"': {
+        const char *string_end = jsontok_scan_string(ptr, end, NULL);
+        if (!string_end) return jsontok_cursor_fail(cursor, JSON_EFMT);
+        event->type = JSON_EVENT_STRING;
+        event->string = ptr + 1;
+        event->length = string_end - ptr - 1;
+        cursor->ptr = string_end + 1;
+        return 1;
+      }
+      case 't':
+      case 'f':
+        event->type = JSON_EVENT_BOOLEAN;
+        event->boolean = *ptr == 't';
+        cursor->ptr = event->boolean ? jsontok_scan_literal(ptr, end, "true", 4) : jsontok_scan_literal(ptr, end, "false", 5);
+        if (!cursor->ptr) return jsontok_cursor_fail(cursor, JSON_EFMT);
+        return 1;
+      case 'n':
+        event->type = JSON_EVENT_NULL;
+        cursor->ptr = jsontok_scan_literal(ptr, end, "null", 4);
+        if (!cursor->ptr) return jsontok_cursor_fail(cursor, JSON_EFMT);
+        return 1;
+      default:
+        event->type = JSON_EVENT_NUMBER;
+        cursor->ptr = jsontok_scan_number_bounded(ptr, end, &event->number);
+        if (!cursor->ptr) return jsontok_cursor_fail(cursor, JSON_EFMT);
+        return 1;
+    }
+  }
+}
+
+unsigned char jsontok_cursor_skip(struct JsonCursor *cursor) {
+  const char *ptr;
+  if (cursor->opened) {
+    ptr = jsontok_skip_container(cursor->opened, cursor->end);
+    cursor->depth--;
+  } else if (cursor->state == JSON_CURSOR_VALUE) {
+    ptr = jsontok_skip_value(cursor->ptr, cursor->end);
+  } else {
+    return 0;
+  }
+  cursor->opened = NULL;
+  if (!ptr) return jsontok_cursor_fail(cursor, JSON_EFMT);
+  cursor->ptr = ptr;
+  cursor->state = JSON_CURSOR_AFTER_VALUE;
+  return 1;
+}
+
+enum JsonError jsontok_sax_parse(const char *buf, size_t len, const struct JsonSaxHandler *handler, void *ctx) {
+  struct JsonCursor cursor = jsontok_cursor_init(buf, len);
+  struct JsonEvent event;
+  while (jsontok_cursor_next(&cursor, &event)) {
+    enum JsonSaxAction action = JSON_SAX_CONTINUE;
+    switch (event.type) {
+      case JSON_EVENT_START_OBJECT:
+        if (handler->start_object) action = handler->start_object(ctx);
+        break;
+      case JSON_EVENT_END_OBJECT:
+        if (handler->end_object) handler->end_object(ctx);
+        break;
+      case JSON_EVENT_START_ARRAY:
+        if (handler->start_array) action = handler->start_array(ctx);
+        break;
+      case JSON_EVENT_END_ARRAY:
+        if (handler->end_array) handler->end_array(ctx);
+        break;
+      case JSON_EVENT_KEY:
+        if (handler->key) action = handler->key(ctx, event.string, event.length);
+        break;
+      case JSON_EVENT_STRING:
+        if (handler->string) handler->string(ctx, event.string, event.length);
+        break;
+      case JSON_EVENT_NUMBER:
+        if (handler->number) handler->number(ctx, event.number);
+        break;
+      case JSON_EVENT_BOOLEAN:
+        if (handler->boolean) handler->boolean(ctx, event.boolean);
+        break;
+      case JSON_EVENT_NULL:
+        if (handler->null) handler->null(ctx);
+        break;
+    }
+    if (action == JSON_SAX_SKIP) jsontok_cursor_skip(&cursor);
+  }
+  return cursor.error;
+}
+
+#ifdef JSONTOK_POSIX
+/**
+ * Snapshot layout, native byte order, every node 8-byte aligned and every
+ * offset relative to the start of the node that holds it:
+ *
+ *   header   "JSONTOK" magic, version, byte order mark, file size
+ *   node     uint32 type, uint32 count/length/boolean
+ *   number   node + double
+ *   string   node + bytes + NUL
+ *   array    node + uint64 size + uint64 offsets[count] + elements
+ *   object   node + uint64 size + uint32 capacity + pad
+ *            + entries[count] + uint32 slots[capacity] + keys and values
+ *
+ * The size of a container covers all of its children, so it can be skipped
+ * in one step, and the slots form an open-addressed table of entry indices
+ * keyed by the hashes of the keys.
+ */
+#define JSONTOK_SNAPSHOT_VERSION 1
+#define JSONTOK_SNAPSHOT_BOM 0x01020304u
+#define JSONTOK_SNAPSHOT_HEADER 32
+
+struct JsonSnapshot {
+  const unsigned char *base;
+  size_t size;
+};
+
+struct JsonSnapshotEntry {
+  uint64_t key;
+  uint64_t value;
+  uint32_t hash;
+  uint32_t key_length;
+};
+
+struct JsonSnapshotBuffer {
+  unsigned char *data;
+  size_t length;
+  size_t capacity;
+};
+
+struct JsonSnapshotFrame {
+  const struct JsonToken *token;
+  struct JsonToken *expanded;
+  size_t node;
+  size_t index;
+};
+
+static uint32_t jsontok_hash(const char *data, size_t length) {
+  uint32_t hash = 2166136261u;
+  size_t i;
+  for (i = 0; i < length; i++) {
+    hash ^= (unsigned char)data[i];
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+static size_t jsontok_snapshot_reserve(struct JsonSnapshotBuffer *buffer, size_t size) {
+  size_t offset = buffer->length;
+  size = (size + 7) & ~(size_t)7;
+  if (offset + size > buffer->capacity) {
+    size_t capacity = buffer->capacity ? buffer->capacity : 4096;
+    while (capacity < offset + size) capacity *= 2;
+    unsigned char *data = realloc(buffer->data, capacity);
+    if (!data) return (size_t)-1;
+    buffer->data = data;
+    buffer->capacity = capacity;
+  }
+  memset(buffer->data + offset, 0, size);
+  buffer->length += size;
+  return offset;
+}
+
+static size_t jsontok_snapshot_node(struct JsonSnapshotBuffer *buffer, const struct JsonToken *token, enum JsonError *error) {
+  const char *string = token->type == JSON_STRING && token->lazy ? token->as_raw + 1 : token->as_string;
+  double number = token->type == JSON_NUMBER && !token->lazy ? (token->integer ? (double)token->as_int64 : token->as_number) : 0;
+  size_t count = 0;
+  size_t capacity = 1;
+  size_t size = 8;
+  switch (token->type) {
+    case JSON_STRING:
+      /* For lazy strings the raw span is an upper bound of the decoded length */
+      count = token->lazy ? (size_t)(jsontok_scan_string(token->as_raw, NULL, NULL) - string) : strlen(string);
+      size += count + 1;
+      break;
+    case JSON_NUMBER:
+      if (token->lazy) {
+        const char *raw = token->as_raw;
+        if (!jsontok_parse_number(&raw, &number, error)) return (size_t)-1;
+      }
+      size += sizeof(double);
+      break;
+    case JSON_BOOLEAN:
+      count = token->as_boolean;
+      break;
+    case JSON_ARRAY:
+      count = token->as_array->length;
+      size += 8 + count * 8;
+      break;
+    case JSON_OBJECT:
+      count = token->as_object->count;
+      while (capacity < count * 2) capacity *= 2;
+      size += 16 + count * sizeof(struct JsonSnapshotEntry) + capacity * 4;
+      break;
+    default:
+      break;
+  }
+  size_t node = jsontok_snapshot_reserve(buffer, size);
+  if (node == (size_t)-1) {
+    *error = JSON_ENOMEM;
+    return node;
+  }
+  unsigned char *data = buffer->data + node;
+  if (token->type == JSON_STRING && token->escaped) {
+    const char *end;
+    char *tail = jsontok_decode_string(string, (char *)data + 8, (size_t)-1, &end, error);
+    if (!tail) return (size_t)-1;
+    count = tail - ((char *)data + 8);
+  } else if (token->type == JSON_STRING) {
+    memcpy(data + 8, string, count);
+  }
+  ((uint32_t *)data)[0] = token->type;
+  ((uint32_t *)data)[1] = (uint32_t)count;
+  if (token->type == JSON_NUMBER) memcpy(data + 8, &number, sizeof(double));
+  if (token->type == JSON_OBJECT) ((uint32_t *)data)[4] = (uint32_t)capacity;
+  return node;
+}
+
+static const struct JsonToken *jsontok_snapshot_expand(const struct JsonToken *token, struct JsonToken **expanded, enum JsonError *error) {
+  *expanded = NULL;
+  if (token->type != JSON_WRAPPED_OBJECT && token->type != JSON_WRAPPED_ARRAY) return token;
+  *expanded = jsontok_parse_deep(token->as_string, 0, error);
+  return *expanded;
+}
+
+static enum JsonError jsontok_snapshot_abort(struct JsonSnapshotBuffer *buffer, struct JsonSnapshotFrame *frames, size_t depth, enum JsonError error) {
+  while (depth > 0) jsontok_free(frames[--depth].expanded);
+  free(frames);
+  free(buffer->data);
+  return error;
+}
+
+static enum JsonError jsontok_snapshot_push(struct JsonSnapshotBuffer *buffer, struct JsonSnapshotFrame **frames, size_t *depth, size_t *capacity, const struct JsonToken *token, struct JsonToken *expanded) {
+  enum JsonError error = JSON_ENOERR;
+  size_t node = jsontok_snapshot_node(buffer, token, &error);
+  if (node == (size_t)-1) {
+    jsontok_free(expanded);
+    return error;
+  }
+  if (token->type != JSON_ARRAY && token->type != JSON_OBJECT) return JSON_ENOERR;
+  if (*depth == *capacity) {
+    size_t grown = *capacity ? *capacity * 2 : 16;
+    struct JsonSnapshotFrame *resized = realloc(*frames, grown * sizeof(struct JsonSnapshotFrame));
+    if (!resized) {
+      jsontok_free(expanded);
+      return JSON_ENOMEM;
+    }
+    *frames = resized;
+    *capacity = grown;
+  }
+  (*frames)[*depth].token = token;
+  (*frames)[*depth].expanded = expanded;
+  (*frames)[*depth].node = node;
+  (*frames)[*depth].index = 0;
+  (*depth)++;
+  return JSON_ENOERR;
+}
+
+enum JsonError jsontok_snapshot_write(const struct JsonToken *token, int fd) {
+  struct JsonSnapshotBuffer buffer;
+  struct JsonSnapshotFrame *frames = NULL;
+  struct JsonToken *expanded;
+  size_t depth = 0;
+  size_t capacity = 0;
+  enum JsonError error = JSON_ENOERR;
+  if (!token) return JSON_EFMT;
+  buffer.data = NULL;
+  buffer.length = 0;
+  buffer.capacity = 0;
+  if (jsontok_snapshot_reserve(&buffer, JSONTOK_SNAPSHOT_HEADER) == (size_t)-1) return JSON_ENOMEM;
+  token = jsontok_snapshot_expand(token, &expanded, &error);
+  if (!token) return jsontok_snapshot_abort(&buffer, frames, depth, error);
+  error = jsontok_snapshot_push(&buffer, &frames, &depth, &capacity, token, expanded);
+  if (error) return jsontok_snapshot_abort(&buffer, frames, depth, error);
+  /* Children are appended right after their parent's table, depth first */
+  while (depth > 0) {
+    struct JsonSnapshotFrame *frame = &frames[depth - 1];
+    const struct JsonToken *parent = frame->token;
+    size_t count = parent->type == JSON_ARRAY ? parent->as_array->length : parent->as_object->count;
+    if (frame->index == count) {
+      ((uint64_t *)(buffer.data + frame->node))[1] = buffer.length - frame->node;
+      jsontok_free(frame->expanded);
+      depth--;
+      continue;
+    }
+    size_t index = frame->index++;
+    size_t node = frame->node;
+    const struct JsonToken *child;
+    if (parent->type == JSON_ARRAY) {
+      child = parent->as_array->elements[index];
+    } else {
+      const char *key = parent->as_object->entries[index]->key;
+      size_t key_length = parent->as_object->entries[index]->key_length;
+      size_t key_offset = jsontok_snapshot_reserve(&buffer, key_length + 1);
+      if (key_offset == (size_t)-1) return jsontok_snapshot_abort(&buffer, frames, depth, JSON_ENOMEM);
+      memcpy(buffer.data + key_offset, key, key_length);
+      struct JsonSnapshotEntry *entries = (struct JsonSnapshotEntry *)(buffer.data + node + 24);
+      uint32_t slot_capacity = ((uint32_t *)(buffer.data + node))[4];
+      uint32_t *slots = (uint32_t *)(entries + count);
+      uint32_t hash = jsontok_hash(key, key_length);
+      uint32_t slot = hash & (slot_capacity - 1);
+      entries[index].key = key_offset - node;
+      entries[index].hash = hash;
+      entries[index].key_length = (uint32_t)key_length;
+      while (slots[slot]) slot = (slot + 1) & (slot_capacity - 1);
+      slots[slot] = (uint32_t)index + 1;
+      child = parent->as_object->entries[index]->value;
+    }
+    size_t child_node = buffer.length;
+    child = jsontok_snapshot_expand(child, &expanded, &error);
+    if (!child) return jsontok_snapshot_abort(&buffer, frames, depth, error);
+    error = jsontok_snapshot_push(&buffer, &frames, &depth, &capacity, child, expanded);
+    if (error) return jsontok_snapshot_abort(&buffer, frames, depth, error);
+    if (parent->type == JSON_ARRAY) {
+      ((uint64_t *)(buffer.data + node))[2 + index] = child_node - node;
+    } else {
+      ((struct JsonSnapshotEntry *)(buffer.data + node + 24))[index].value = child_node - node;
+    }
+  }
+  free(frames);
+  memcpy(buffer.data, "JSONTOK", 8);
+  ((uint32_t *)buffer.data)[2] = JSONTOK_SNAPSHOT_VERSION;
+  ((uint32_t *)buffer.data)[3] = JSONTOK_SNAPSHOT_BOM;
+  ((uint64_t *)buffer.data)[2] = buffer.length;
+  size_t written = 0;
+  while (written < buffer.length) {
+    ssize_t result = write(fd, buffer.data + written, buffer.length - written);
+    if (result < 0 && errno == EINTR) continue;
+    if (result <= 0) {
+      free(buffer.data);
+      return JSON_EIO;
+    }
+    written += result;
+  }
+  free(buffer.data);
+  return JSON_ENOERR;
+}
+
+struct JsonSnapshot *jsontok_snapshot_open(const char *path, enum JsonError *error) {
+  struct stat info;
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    *error = JSON_EIO;
+    return NULL;
+  }
+  if (fstat(fd, &info) < 0) {
+    close(fd);
+    *error = JSON_EIO;
+    return NULL;
+  }
+  if ((size_t)info.st_size < JSONTOK_SNAPSHOT_HEADER + 8) {
+    close(fd);
     *error = JSON_EFMT;
     return NULL;
   }
-  strncpy(substr, *json_string, length);
-  substr[length] = '\0';
-  *json_string = ptr + 1;
-  return substr;
+  void *base = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (base == MAP_FAILED) {
+    *error = JSON_EIO;
+    return NULL;
+  }
+  const uint32_t *header = base;
+  if (memcmp(base, "JSONTOK", 8) || header[2] != JSONTOK_SNAPSHOT_VERSION || header[3] != JSONTOK_SNAPSHOT_BOM || ((const uint64_t *)base)[2] != (uint64_t)info.st_size) {
+    munmap(base, info.st_size);
+    *error = JSON_EFMT;
+    return NULL;
+  }
+  struct JsonSnapshot *snapshot = malloc(sizeof(struct JsonSnapshot));
+  if (!snapshot) {
+    munmap(base, info.st_size);
+    *error = JSON_ENOMEM;
+    return NULL;
+  }
+  snapshot->base = base;
+  snapshot->size = info.st_size;
+  return snapshot;
+}
+
+void jsontok_snapshot_close(struct JsonSnapshot *snapshot) {
+  if (!snapshot) return;
+  munmap((void *)snapshot->base, snapshot->size);
+  free(snapshot);
+}
+
+const struct JsonSnapshotNode *jsontok_snapshot_root(const struct JsonSnapshot *snapshot) {
+  return (const struct JsonSnapshotNode *)(snapshot->base + JSONTOK_SNAPSHOT_HEADER);
+}
+
+enum JsonType jsontok_snapshot_type(const struct JsonSnapshotNode *node) {
+  return (enum JsonType)((const uint32_t *)node)[0];
+}
+
+size_t jsontok_snapshot_length(const struct JsonSnapshotNode *node) {
+  return ((const uint32_t *)node)[1];
+}
+
+const char *jsontok_snapshot_string(const struct JsonSnapshotNode *node) {
+  return (const char *)node + 8;
+}
+
+double jsontok_snapshot_number(const struct JsonSnapshotNode *node) {
+  double number;
+  memcpy(&number, (const char *)node + 8, sizeof(double));
+  return number;
+}
+
+unsigned char jsontok_snapshot_boolean(const struct JsonSnapshotNode *node) {
+  return ((const uint32_t *)node)[1] != 0;
+}
+
+const struct JsonSnapshotNode *jsontok_snapshot_element(const struct JsonSnapshotNode *node, size_t index) {
+  if (jsontok_snapshot_type(node) != JSON_ARRAY || index >= jsontok_snapshot_length(node)) return NULL;
+  return (const struct JsonSnapshotNode *)((const char *)node + ((const uint64_t *)node)[2 + index]);
+}
+
+const char *jsontok_snapshot_key(const struct JsonSnapshotNode *node, size_t index) {
+  if (jsontok_snapshot_type(node) != JSON_OBJECT || index >= jsontok_snapshot_length(node)) return NULL;
+  return (const char *)node + ((const struct JsonSnapshotEntry *)((const char *)node + 24))[index].key;
+}
+
+const struct JsonSnapshotNode *jsontok_snapshot_value(const struct JsonSnapshotNode *node, size_t index) {
+  if (jsontok_snapshot_type(node) != JSON_OBJECT || index >= jsontok_snapshot_length(node)) return NULL;
+  return (const struct JsonSnapshotNode *)((const char *)node + ((const struct JsonSnapshotEntry *)((const char *)node + 24))[index].value);
+}
+
+const struct JsonSnapshotNode *jsontok_snapshot_get(const struct JsonSnapshotNode *node, const char *key) {
+  if (!key) return NULL;
+  size_t length = strlen(key);
+  return jsontok_snapshot_get_hashed(node, key, length, jsontok_hash(key, length));
+}
+
+const struct JsonSnapshotNode *jsontok_snapshot_get_hashed(const struct JsonSnapshotNode *node, const char *key, size_t length, uint32_t hash) {
+  if (jsontok_snapshot_type(node) != JSON_OBJECT || !key) return NULL;
+  const struct JsonSnapshotEntry *entries = (const struct JsonSnapshotEntry *)((const char *)node + 24);
+  uint32_t capacity = ((const uint32_t *)node)[4];
+  const uint32_t *slots = (const uint32_t *)(entries + jsontok_snapshot_length(node));
+  uint32_t slot = hash & (capacity - 1);
+  while (slots[slot]) {
+    const struct JsonSnapshotEntry *entry = &entries[slots[slot] - 1];
+    if (entry->hash == hash && entry->key_length == length && !memcmp((const char *)node + entry->key, key, length)) {
+      return (const struct JsonSnapshotNode *)((const char *)node + entry->value);
+    }
+    slot = (slot + 1) & (capacity - 1);
+  }
+  return NULL;
+}
+
+/**
+ * The root token is the first member so a token handed out by the cache
+ * converts back to its entry, and jsontok_free on it releases the entry.
+ */
+struct JsonCacheEntry {
+  struct JsonToken root;
+  struct JsonCacheEntry *chain;
+  struct JsonCacheEntry *newer;
+  struct JsonCacheEntry *older;
+  char *json;
+  size_t length;
+  uint64_t hash;
+  size_t cost;
+  size_t refs;
+};
+
+struct JsonCache {
+  pthread_mutex_t lock;
+  struct JsonCacheEntry **buckets;
+  size_t bucket_count;
+  struct JsonCacheEntry *newest;
+  struct JsonCacheEntry *oldest;
+  size_t budget;
+  struct JsonCacheStats stats;
+};
+
+static uint64_t jsontok_content_hash(const char *data, size_t length) {
+  uint64_t hash = 0x9E3779B97F4A7C15u ^ length;
+  uint64_t word;
+  while (length >= 8) {
+    memcpy(&word, data, 8);
+    hash = (hash ^ word) * 0xFF51AFD7ED558CCDu;
+    hash ^= hash >> 32;
+    data += 8;
+    length -= 8;
+  }
+  word = 0;
+  memcpy(&word, data, length);
+  hash = (hash ^ word) * 0xC4CEB9FE1A85EC53u;
+  return hash ^ (hash >> 29);
+}
+
+static size_t jsontok_token_cost(const struct JsonToken *token) {
+  size_t cost = sizeof(struct JsonToken);
+  size_t i;
+  switch (token->type) {
+    case JSON_ARRAY:
+      cost += sizeof(struct JsonArray) + token->as_array->length * sizeof(struct JsonToken *);
+      for (i = 0; i < token->as_array->length; i++) {
+        const struct JsonToken *element = token->as_array->elements[i];
+        cost += element->type == JSON_ARRAY || element->type == JSON_OBJECT ? sizeof(struct JsonToken) : jsontok_token_cost(element);
+      }
+      break;
+    case JSON_OBJECT:
+      cost += sizeof(struct JsonObject) + token->as_object->count * (sizeof(struct JsonEntry *) + sizeof(struct JsonEntry));
+      for (i = 0; i < token->as_object->count; i++) {
+        const struct JsonToken *value = token->as_object->entries[i]->value;
+        cost += token->as_object->entries[i]->key_length + 1;
+        cost += value->type == JSON_ARRAY || value->type == JSON_OBJECT ? sizeof(struct JsonToken) : jsontok_token_cost(value);
+      }
+      break;
+    case JSON_STRING:
+    case JSON_WRAPPED_OBJECT:
+    case JSON_WRAPPED_ARRAY:
+      cost += strlen(token->as_string) + 1;
+      break;
+    default:
+      break;
+  }
+  return cost;
+}
+
+static void jsontok_cache_unlink(struct JsonCache *cache, struct JsonCacheEntry *entry) {
+  if (entry->newer) {
+    entry->newer->older = entry->older;
+  } else {
+    cache->newest = entry->older;
+  }
+  if (entry->older) {
+    entry->older->newer = entry->newer;
+  } else {
+    cache->oldest = entry->newer;
+  }
+}
+
+static void jsontok_cache_link(struct JsonCache *cache, struct JsonCacheEntry *entry) {
+  entry->newer = NULL;
+  entry->older = cache->newest;
+  if (cache->newest) {
+    cache->newest->newer = entry;
+  } else {
+    cache->oldest = entry;
+  }
+  cache->newest = entry;
+}
+
+static void jsontok_cache_evict(struct JsonCache *cache, struct JsonCacheEntry *entry) {
+  struct JsonCacheEntry **link = &cache->buckets[entry->hash & (cache->bucket_count - 1)];
+  while (*link != entry) link = &(*link)->chain;
+  *link = entry->chain;
+  jsontok_cache_unlink(cache, entry);
+  cache->stats.entries--;
+  cache->stats.bytes -= entry->cost;
+  free(entry->json);
+  jsontok_free(&entry->root);
+}
+
+static void jsontok_cache_trim(struct JsonCache *cache) {
+  struct JsonCacheEntry *entry = cache->oldest;
+  while (entry && cache->stats.bytes > cache->budget) {
+    struct JsonCacheEntry *newer = entry->newer;
+    if (entry->refs == 0) {
+      jsontok_cache_evict(cache, entry);
+      cache->stats.evictions++;
+    }
+    entry = newer;
+  }
+}
+
+static void jsontok_cache_grow(struct JsonCache *cache) {
+  size_t bucket_count = cache->bucket_count * 2;
+  struct JsonCacheEntry **buckets = calloc(bucket_count, sizeof(struct JsonCacheEntry *));
+  size_t i;
+  /* Keeping the old table is only slower, so a failed resize is not an error */
+  if (!buckets) return;
+  for (i = 0; i < cache->bucket_count; i++) {
+    struct JsonCacheEntry *entry = cache->buckets[i];
+    while (entry) {
+      struct JsonCacheEntry *chain = entry->chain;
+      entry->chain = buckets[entry->hash & (bucket_count - 1)];
+      buckets[entry->hash & (bucket_count - 1)] = entry;
+      entry = chain;
+    }
+  }
+  free(cache->buckets);
+  cache->buckets = buckets;
+  cache->bucket_count = bucket_count;
+}
+
+static struct JsonCacheEntry *jsontok_cache_find(struct JsonCache *cache, const char *json_string, size_t length, uint64_t hash) {
+  struct JsonCacheEntry *entry = cache->buckets[hash & (cache->bucket_count - 1)];
+  for (; entry; entry = entry->chain) {
+    if (entry->hash == hash && entry->length == length && !memcmp(entry->json, json_string, length)) {
+      entry->refs++;
+      jsontok_cache_unlink(cache, entry);
+      jsontok_cache_link(cache, entry);
+      return entry;
+    }
+  }
+  return NULL;
+}
+
+struct JsonCache *jsontok_cache_create(size_t budget) {
+  struct JsonCache *cache = malloc(sizeof(struct JsonCache));
+  if (!cache) return NULL;
+  cache->bucket_count = 16;
+  cache->buckets = calloc(cache->bucket_count, sizeof(struct JsonCacheEntry *));
+  if (!cache->buckets) {
+    free(cache);
+    return NULL;
+  }
+  if (pthread_mutex_init(&cache->lock, NULL)) {
+    free(cache->buckets);
+    free(cache);
+    return NULL;
+  }
+  cache->newest = NULL;
+  cache->oldest = NULL;
+  cache->budget = budget;
+  memset(&cache->stats, 0, sizeof(struct JsonCacheStats));
+  return cache;
+}
+
+void jsontok_cache_destroy(struct JsonCache *cache) {
+  if (!cache) return;
+  while (cache->oldest) jsontok_cache_evict(cache, cache->oldest);
+  pthread_mutex_destroy(&cache->lock);
+  free(cache->buckets);
+  free(cache);
+}
+
+const struct JsonToken *jsontok_cache_parse(struct JsonCache *cache, const char *json_string, enum JsonError *error) {
+  if (!json_string) {
+    *error = JSON_EFMT;
+    return NULL;
+  }
+  size_t length = strlen(json_string);
+  uint64_t hash = jsontok_content_hash(json_string, length);
+  pthread_mutex_lock(&cache->lock);
+  struct JsonCacheEntry *entry = jsontok_cache_find(cache, json_string, length, hash);
+  if (entry) {
+    cache->stats.hits++;
+    pthread_mutex_unlock(&cache->lock);
+    return &entry->root;
+  }
+  cache->stats.misses++;
+  pthread_mutex_unlock(&cache->lock);
+
+  /* Parse outside the lock so a slow miss does not stall hits on other threads */
+  struct JsonToken *token = jsontok_parse(json_string, error);
+  if (!token) return NULL;
+  entry = malloc(sizeof(struct JsonCacheEntry));
+  char *json = malloc(length + 1);
+  if (!entry || !json) {
+    free(entry);
+    free(json);
+    jsontok_free(token);
+    *error = JSON_ENOMEM;
+    return NULL;
+  }
+  memcpy(json, json_string, length + 1);
+  entry->root = *token;
+  free(token);
+  entry->json = json;
+  entry->length = length;
+  entry->hash = hash;
+  entry->refs = 1;
+  entry->cost = sizeof(struct JsonCacheEntry) + length + 1 + jsontok_token_cost(&entry->root) - sizeof(struct JsonToken);
+
+  pthread_mutex_lock(&cache->lock);
+  struct JsonCacheEntry *raced = jsontok_cache_find(cache, json_string, length, hash);
+  if (raced) {
+    pthread_mutex_unlock(&cache->lock);
+    free(entry->json);
+    jsontok_free(&entry->root);
+    return &raced->root;
+  }
+  if (cache->stats.entries >= cache->bucket_count) jsontok_cache_grow(cache);
+  entry->chain = cache->buckets[hash & (cache->bucket_count - 1)];
+  cache->buckets[hash & (cache->bucket_count - 1)] = entry;
+  jsontok_cache_link(cache, entry);
+  cache->stats.entries++;
+  cache->stats.bytes += entry->cost;
+  jsontok_cache_trim(cache);
+  pthread_mutex_unlock(&cache->lock);
+  return &entry->root;
+}
+
+void jsontok_cache_release(struct JsonCache *cache, const struct JsonToken *token) {
+  struct JsonCacheEntry *entry = (struct JsonCacheEntry *)token;
+  if (!token) return;
+  pthread_mutex_lock(&cache->lock);
+  if (--entry->refs == 0) jsontok_cache_trim(cache);
+  pthread_mutex_unlock(&cache->lock);
+}
+
+void jsontok_cache_stats(struct JsonCache *cache, struct JsonCacheStats *stats) {
+  pthread_mutex_lock(&cache->lock);
+  *stats = cache->stats;
+  pthread_mutex_unlock(&cache->lock);
+}
+#endif
+
+#ifdef JSONTOK_POSIX
+#define JSONTOK_PIPE_CHUNKS 4
+#define JSONTOK_PIPE_CHUNK_SIZE (64 << 10)
+
+/**
+ * A bounded queue of chunks between the thread running the source and the
+ * parser. Slots from head to head + count are full; the producer only writes
+ * the slot after them, so filling and draining happen outside the lock.
+ */
+struct JsonPipe {
+  const struct JsonSource *source;
+  pthread_mutex_t lock;
+  pthread_cond_t changed;
+  char *chunks[JSONTOK_PIPE_CHUNKS];
+  size_t lengths[JSONTOK_PIPE_CHUNKS];
+  size_t head;
+  size_t count;
+  unsigned char finished;
+  unsigned char failed;
+  unsigned char stopped;
+};
+
+/**
+ * The input not yet parsed, from start to length, kept NUL terminated.
+ * A container member that has not fully arrived is scanned up to scanned
+ * bytes past start, with depth, the opener of each level and
+ * in_string/escape saved from there. mismatched is set on a wrong closer.
+ */
+struct JsonWindow {
+  char *data;
+  size_t start;
+  size_t length;
+  size_t capacity;
+  size_t received;
+  size_t scanned;
+  size_t depth;
+  unsigned char in_object[JSONTOK_DEFAULT_MAX_DEPTH / 8];
+  unsigned char in_string;
+  unsigned char escape;
+  unsigned char mismatched;
+  unsigned char eof;
+};
+
+/* Continues finding the end of the container member where the last call stopped */
+static const char *jsontok_window_skip(struct JsonWindow *window, const char *value, const char *end) {
+  const char *ptr = window->scanned ? window->data + window->start + window->scanned : value;
+  for (; ptr != end; ptr++) {
+    if (window->in_string) {
+      if (window->escape) {
+        window->escape = 0;
+      } else if (*ptr == '\\') {
+        window->escape = 1;
+      } else if (*ptr == '"') {
+        window->in_string = 0;
+      }
+    } else if (*ptr == '"') {
+      window->in_string = 1;
+    } else if (*ptr == '{' || *ptr == '[') {
+      size_t depth = window->depth++;
+      if (depth < JSONTOK_DEFAULT_MAX_DEPTH) {
+        if (*ptr == '{') {
+          window->in_object[depth / 8] |= 1 << (depth % 8);
+        } else {
+          window->in_object[depth / 8] &= ~(1 << (depth % 8));
+        }
+      }
+    } else if (*ptr == '}' || *ptr == ']') {
+      size_t depth = --window->depth;
+      if (depth < JSONTOK_DEFAULT_MAX_DEPTH && (window->in_object[depth / 8] >> (depth % 8) & 1) != (*ptr == '}')) {
+        window->mismatched = 1;
+        return NULL;
+      }
+      if (depth == 0) {
+        window->scanned = 0;
+        return ptr + 1;
+      }
+    }
+  }
+  window->scanned = end - (window->data + window->start);
+  return NULL;
+}
+
+static void *jsontok_pipe_produce(void *arg) {
+  struct JsonPipe *pipe = arg;
+  pthread_mutex_lock(&pipe->lock);
+  while (1) {
+    while (pipe->count == JSONTOK_PIPE_CHUNKS && !pipe->stopped) pthread_cond_wait(&pipe->changed, &pipe->lock);
+    if (pipe->stopped) break;
+    size_t slot = (pipe->head + pipe->count) % JSONTOK_PIPE_CHUNKS;
+    pthread_mutex_unlock(&pipe->lock);
+    size_t length = pipe->source->read(pipe->source->ctx, pipe->chunks[slot], JSONTOK_PIPE_CHUNK_SIZE);
+    pthread_mutex_lock(&pipe->lock);
+    if (length == 0 || length == (size_t)-1) {
+      pipe->finished = 1;
+      pipe->failed = length != 0;
+      pthread_cond_broadcast(&pipe->changed);
+      break;
+    }
+    pipe->lengths[slot] = length;
+    pipe->count++;
+    pthread_cond_broadcast(&pipe->changed);
+  }
+  pthread_mutex_unlock(&pipe->lock);
+  return NULL;
+}
+
+static enum JsonError jsontok_window_fill(struct JsonWindow *window, struct JsonPipe *pipe, const struct JsonContext *ctx) {
+  pthread_mutex_lock(&pipe->lock);
+  while (!pipe->count && !pipe->finished) pthread_cond_wait(&pipe->changed, &pipe->lock);
+  if (!pipe->count) {
+    pthread_mutex_unlock(&pipe->lock);
+    if (pipe->failed) return JSON_EIO;
+    window->eof = 1;
+    return JSON_ENOERR;
+  }
+  size_t slot = pipe->head;
+  size_t length = pipe->lengths[slot];
+  pthread_mutex_unlock(&pipe->lock);
+  window->received += length;
+  if (window->received > ctx->budget->max_document_size) return JSON_ELIMIT;
+  if (window->start) {
+    memmove(window->data, window->data + window->start, window->length - window->start);
+    window->length -= window->start;
+    window->start = 0;
+  }
+  if (window->length + length + 1 > window->capacity) {
+    size_t capacity = window->capacity * 2;
+    if (capacity < window->length + length + 1) capacity = window->length + length + 1;
+    char *data = jsontok_realloc(ctx->budget->inner, window->data, capacity);
+    if (!data) return JSON_ENOMEM;
+    window->data = data;
+    window->capacity = capacity;
+  }
+  memcpy(window->data + window->length, pipe->chunks[slot], length);
+  window->length += length;
+  window->data[window->length] = '\0';
+  pthread_mutex_lock(&pipe->lock);
+  pipe->head = (pipe->head + 1) % JSONTOK_PIPE_CHUNKS;
+  pipe->count--;
+  pthread_cond_broadcast(&pipe->changed);
+  pthread_mutex_unlock(&pipe->lock);
+  return JSON_ENOERR;
+}
+
+/**
+ * Makes the wrapped token of the complete container member from value to
+ * value_end and moves the window past it. A member of a chunk or more keeps
+ * the window buffer as its text while what follows it moves to a new buffer,
+ * so the largest member is never held twice.
+ */
+static struct JsonToken *jsontok_window_wrap(struct JsonWindow *window, const char *value, const char *value_end, const struct JsonContext *ctx, enum JsonError *error) {
+  size_t length = value_end - value;
+  size_t rest = window->data + window->length - value_end;
+  struct JsonToken *token = jsontok_new_token(ctx, error);
+  if (!token) return NULL;
+  token->type = *value == '{' ? JSON_WRAPPED_OBJECT : JSON_WRAPPED_ARRAY;
+  if (length < JSONTOK_PIPE_CHUNK_SIZE) {
+    token->as_string = jsontok_wrap_span(value, value_end, ctx, error);
+    if (!token->as_string) {
+      jsontok_dealloc(ctx->allocator, token);
+      return NULL;
+    }
+    window->start = value_end - window->data;
+    return token;
+  }
+  size_t capacity = rest < JSONTOK_PIPE_CHUNK_SIZE ? JSONTOK_PIPE_CHUNK_SIZE + 1 : rest + 1;
+  char *data = jsontok_alloc(ctx->budget->inner, capacity);
+  if (!data || !jsontok_charge(ctx->budget, length + 1)) {
+    jsontok_dealloc(ctx->budget->inner, data);
+    jsontok_dealloc(ctx->allocator, token);
+    *error = data ? JSON_ELIMIT : JSON_ENOMEM;
+    return NULL;
+  }
+  memcpy(data, value_end, rest + 1);
+  char *text = window->data;
+  memmove(text, value, length);
+  if (ctx->flags & JSON_PARSE_MINIFY) length = jsontok_minify(text, length, text);
+  text[length] = '\0';
+  /* Shrinking usually leaves the block in place, and a failure keeps the larger one */
+  token->as_string = jsontok_realloc(ctx->budget->inner, text, length + 1);
+  if (!token->as_string) token->as_string = text;
+  window->data = data;
+  window->start = 0;
+  window->length = rest;
+  window->capacity = capacity;
+  return token;
+}
+
+/**
+ * Parses the top level of a document as it arrives. Each member is parsed
+ * once all of its text is in the window, so besides the tree only the queued
+ * chunks and the text of the member being read are held.
+ */
+static struct JsonToken *jsontok_parse_pipe(struct JsonWindow *window, struct JsonPipe *pipe, const struct JsonContext *ctx, enum JsonError *error) {
+  enum { OPEN, FIRST, MEMBER, SEPARATOR, TRAILING } state = OPEN;
+  struct JsonFrame frame;
+  char close = '\0';
+  frame.token = NULL;
+  frame.capacity = 0;
+  while (1) {
+    const char *end = window->data + window->length;
+    const char *ptr = skip_whitespace_bounded(window->data + window->start, end);
+    const char *value_end = NULL;
+    struct JsonEntry key;
+    window->start = ptr - window->data;
+    if (ptr != end && state == OPEN && (*ptr == '{' || *ptr == '[')) {
+      close = *ptr == '{' ? '}' : ']';
+      frame.token = jsontok_new_container(*ptr, ctx, error);
+      if (!frame.token) return NULL;
+      window->start++;
+      state = FIRST;
+      continue;
+    }
+    if (ptr != end && state == FIRST && *ptr == close) {
+      window->start++;
+      state = TRAILING;
+      continue;
+    }
+    if (ptr != end && (state == FIRST || state == MEMBER)) {
+      const char *value = ptr;
+      if (close == '}') {
+        if (*ptr != '"') {
+          *error = JSON_EFMT;
+          break;
+        }
+        const char *key_end = jsontok_scan_string(ptr, end, NULL);
+        value = key_end ? skip_whitespace_bounded(key_end + 1, end) : end;
+        if (value != end && *value != ':') {
+          *error = JSON_EFMT;
+          break;
+        }
+        if (value != end) value = skip_whitespace_bounded(value + 1, end);
+      }
+      if (value != end && !strchr("{[\"tfn-0123456789", *value)) {
+        *error = JSON_EFMT;
+        break;
+      }
+      /* Numbers and literals are only known to be complete once something follows them */
+      value_end = value != end && (*value == '{' || *value == '[') ? jsontok_window_skip(window, value, end) : jsontok_skip_value(value, end);
+      if (window->mismatched) {
+        *error = JSON_EFMT;
+        break;
+      }
+      if (value_end && value_end != end) {
+        struct JsonToken *child;
+        key.key = NULL;
+        key.lazy = 0;
+        if (close == '}' && !jsontok_parse_key(&ptr, &key, ctx, error)) break;
+        if (*value == '{' || *value == '[') {
+          child = jsontok_window_wrap(window, value, value_end, ctx, error);
+        } else {
+          child = jsontok_parse_value(&value, ctx, error);
+          window->start = value_end - window->data;
+        }
+        if (!child) {
+          jsontok_release_key(&key, ctx);
+          break;
+        }
+        if (!jsontok_append(&frame, close == '}' ? &key : NULL, child, ctx)) {
+          jsontok_release_key(&key, ctx);
+          jsontok_free_tree(child, ctx->allocator);
+          *error = JSON_ENOMEM;
+          break;
+        }
+        state = SEPARATOR;
+        continue;
+      }
+    } else if (ptr != end && state == SEPARATOR) {
+      if (*ptr != ',' && *ptr != close) {
+        *error = JSON_EFMT;
+        break;
+      }
+      window->start++;
+      state = *ptr == ',' ? MEMBER : TRAILING;
+      continue;
+    } else if (ptr != end) {
+      /* A scalar document, or anything after the closing bracket */
+      if (state == TRAILING) {
+        *error = JSON_EFMT;
+        break;
+      }
+    } else if (window->eof && state == TRAILING) {
+      return frame.token;
+    }
+    if (window->eof) {
+      if (state != OPEN) {
+        *error = JSON_EFMT;
+        break;
+      }
+      return jsontok_parse_root(window->data + window->start, ctx, error);
+    }
+    *error = jsontok_window_fill(window, pipe, ctx);
+    if (*error) break;
+  }
+  jsontok_free_tree(frame.token, ctx->allocator);
+  return NULL;
+}
+
+struct JsonToken *jsontok_parser_parse_source(const struct JsonParser *parser, const struct JsonSource *source, enum JsonError *error) {
+  struct JsonContext ctx;
+  struct JsonBudget budget;
+  struct JsonWindow window;
+  struct JsonPipe pipe;
+  struct JsonToken *token = NULL;
+  pthread_t producer;
+  size_t i;
+  jsontok_begin(parser, 0, NULL, &ctx, &budget, error);
+  /**
+   * The window is reused as parsing goes, so nothing may point into it. Its
+   * buffers are scratch space and not counted against max_bytes.
+   */
+  ctx.flags &= ~JSON_PARSE_LAZY;
+  memset(&pipe, 0, sizeof(pipe));
+  pipe.source = source;
+  window.data = NULL;
+  window.start = 0;
+  window.length = 0;
+  window.capacity = 0;
+  window.received = 0;
+  window.scanned = 0;
+  window.depth = 0;
+  window.in_string = 0;
+  window.escape = 0;
+  window.mismatched = 0;
+  window.eof = 0;
+  for (i = 0; i < JSONTOK_PIPE_CHUNKS; i++) {
+    pipe.chunks[i] = jsontok_alloc(budget.inner, JSONTOK_PIPE_CHUNK_SIZE);
+    if (!pipe.chunks[i]) break;
+  }
+  window.data = i == JSONTOK_PIPE_CHUNKS ? jsontok_alloc(budget.inner, JSONTOK_PIPE_CHUNK_SIZE + 1) : NULL;
+  if (!window.data) {
+    while (i > 0) jsontok_dealloc(budget.inner, pipe.chunks[--i]);
+    *error = JSON_ENOMEM;
+    return NULL;
+  }
+  window.capacity = JSONTOK_PIPE_CHUNK_SIZE + 1;
+  window.data[0] = '\0';
+  pthread_mutex_init(&pipe.lock, NULL);
+  pthread_cond_init(&pipe.changed, NULL);
+  if (pthread_create(&producer, NULL, jsontok_pipe_produce, &pipe)) {
+    *error = JSON_ENOMEM;
+  } else {
+    token = jsontok_end(jsontok_parse_pipe(&window, &pipe, &ctx, error), &ctx, error);
+    pthread_mutex_lock(&pipe.lock);
+    pipe.stopped = 1;
+    pthread_cond_broadcast(&pipe.changed);
+    pthread_mutex_unlock(&pipe.lock);
+    pthread_join(producer, NULL);
+  }
+  pthread_mutex_destroy(&pipe.lock);
+  pthread_cond_destroy(&pipe.changed);
+  for (i = 0; i < JSONTOK_PIPE_CHUNKS; i++) jsontok_dealloc(budget.inner, pipe.chunks[i]);
+  jsontok_dealloc(budget.inner, window.data);
+  return token;
+}
+
+#ifdef JSONTOK_ZLIB
+static size_t jsontok_gzip_read(void *ctx, char *buffer, size_t size) {
+  int length = gzread((gzFile)ctx, buffer, (unsigned int)size);
+  return length < 0 ? (size_t)-1 : (size_t)length;
+}
+
+struct JsonToken *jsontok_parse_gzip_file(const char *path, enum JsonError *error) {
+  return jsontok_parser_parse_gzip_file(NULL, path, error);
+}
+
+struct JsonToken *jsontok_parser_parse_gzip_file(const struct JsonParser *parser, const char *path, enum JsonError *error) {
+  struct JsonSource source;
+  gzFile file = path ? gzopen(path, "rb") : NULL;
+  if (!file) {
+    *error = JSON_EIO;
+    return NULL;
+  }
+  gzbuffer(file, JSONTOK_PIPE_CHUNK_SIZE);
+  source.read = jsontok_gzip_read;
+  source.ctx = file;
+  struct JsonToken *token = jsontok_parser_parse_source(parser, &source, error);
+  gzclose(file);
+  return token;
 }
+#endif
+#endif
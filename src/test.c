@@ -1,3 +1,7 @@
+#if !defined(_POSIX_C_SOURCE) && (defined(__unix__) || defined(__APPLE__))
+#define _POSIX_C_SOURCE 200809L
+#endif
+
 #include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -5,6 +9,14 @@
 
 #include "jsontok.h"
 
+#ifdef JSONTOK_POSIX
+#include <pthread.h>
+#include <unistd.h>
+#ifdef JSONTOK_ZLIB
+#include <zlib.h>
+#endif
+#endif
+
 void test_parse_valid_json() {
   enum JsonError error = JSON_ENOERR;
   const char *json_string = "{\"key\":\"value\",\"number\":42,\"array\":[1,2,3],\"nested\":{\"inner_key\":\"inner_value\"}}";
@@ -51,6 +63,18 @@ void test_parse_invalid_json() {
 
   assert(token == NULL);
   assert(error == JSON_EFMT);
+
+  token = jsontok_parse("[1e-400]", &error);
+  assert(token != NULL && token->as_array->elements[0]->as_number == 0);
+  jsontok_free(token);
+  assert(jsontok_parse("[1e400]", &error) == NULL);
+  assert(error == JSON_EFMT);
+
+  /* Nested closers must match their openers */
+  assert(jsontok_parse("{\"a\":[1,2}}", &error) == NULL);
+  assert(error == JSON_EFMT);
+  assert(jsontok_parse("[{\"a\":[1]]]", &error) == NULL);
+  assert(error == JSON_EFMT);
 }
 
 void test_unwrap_json_wrapped_object() {
@@ -92,6 +116,847 @@ void test_get_nonexistent_key() {
   jsontok_free(token);
 }
 
+void test_parse_escaped_string() {
+  enum JsonError error = JSON_ENOERR;
+  const char *json_string = "{\"key\":\"a\\\"b\\\\c\\n\\u00e9\\u20ac\"}";
+  struct JsonToken *token = jsontok_parse(json_string, &error);
+
+  assert(token != NULL);
+  assert(error == JSON_ENOERR);
+
+  struct JsonToken *value_token = jsontok_get(token->as_object, "key");
+  assert(value_token != NULL);
+  assert(value_token->type == JSON_STRING);
+  assert(strcmp(value_token->as_string, "a\"b\\c\n\xc3\xa9\xe2\x82\xac") == 0);
+
+  jsontok_free(token);
+}
+
+void test_parse_insitu() {
+  enum JsonError error = JSON_ENOERR;
+  char json_string[] = "{\"key\":\"va\\tlue\",\"plain\":\"text\",\"nested\":{\"inner_key\":\"inner_value\"}}";
+  struct JsonToken *token = jsontok_parse_insitu(json_string, &error);
+
+  assert(token != NULL);
+  assert(error == JSON_ENOERR);
+  assert(token->type == JSON_OBJECT);
+
+  struct JsonToken *value_token = jsontok_get(token->as_object, "key");
+  assert(value_token != NULL);
+  assert(value_token->type == JSON_STRING);
+  assert(strcmp(value_token->as_string, "va\tlue") == 0);
+  assert(value_token->as_string > json_string && value_token->as_string < json_string + sizeof(json_string));
+
+  struct JsonToken *plain_token = jsontok_get(token->as_object, "plain");
+  assert(plain_token != NULL);
+  assert(strcmp(plain_token->as_string, "text") == 0);
+  assert(plain_token->as_string > json_string && plain_token->as_string < json_string + sizeof(json_string));
+
+  struct JsonToken *nested_token = jsontok_get(token->as_object, "nested");
+  assert(nested_token != NULL);
+  assert(nested_token->type == JSON_WRAPPED_OBJECT);
+  struct JsonToken *unwrapped_token = jsontok_parse_insitu(nested_token->as_string, &error);
+  assert(unwrapped_token != NULL);
+
+  struct JsonToken *inner_key_token = jsontok_get(unwrapped_token->as_object, "inner_key");
+  assert(inner_key_token != NULL);
+  assert(strcmp(inner_key_token->as_string, "inner_value") == 0);
+
+  jsontok_free(unwrapped_token);
+  jsontok_free(token);
+}
+
+void test_parse_deep() {
+  enum JsonError error = JSON_ENOERR;
+  const char *json_string = "{\"key\":\"value\",\"array\":[1,{\"inner\":[true,null]},[]],\"nested\":{\"inner_key\":{}}}";
+  struct JsonToken *token = jsontok_parse_deep(json_string, 0, &error);
+
+  assert(token != NULL);
+  assert(error == JSON_ENOERR);
+  assert(token->type == JSON_OBJECT);
+
+  struct JsonToken *array_token = jsontok_get(token->as_object, "array");
+  assert(array_token != NULL);
+  assert(array_token->type == JSON_ARRAY);
+  assert(array_token->as_array->length == 3);
+  assert(array_token->as_array->elements[0]->as_number == 1);
+  assert(array_token->as_array->elements[2]->type == JSON_ARRAY);
+  assert(array_token->as_array->elements[2]->as_array->length == 0);
+
+  struct JsonToken *inner_token = jsontok_get(array_token->as_array->elements[1]->as_object, "inner");
+  assert(inner_token != NULL);
+  assert(inner_token->type == JSON_ARRAY);
+  assert(inner_token->as_array->elements[0]->type == JSON_BOOLEAN);
+  assert(inner_token->as_array->elements[1]->type == JSON_NULL);
+
+  struct JsonToken *nested_token = jsontok_get(token->as_object, "nested");
+  assert(nested_token != NULL);
+  assert(nested_token->type == JSON_OBJECT);
+  assert(jsontok_get(nested_token->as_object, "inner_key")->type == JSON_OBJECT);
+
+  jsontok_free(token);
+
+  token = jsontok_parse_deep("{\"array\":[1,2,3,]}", 0, &error);
+  assert(token == NULL);
+  assert(error == JSON_EFMT);
+}
+
+void test_parse_deep_nesting() {
+  enum JsonError error = JSON_ENOERR;
+  size_t depth = 100000;
+  char *json_string = malloc(depth * 2 + 1);
+  assert(json_string != NULL);
+  memset(json_string, '[', depth);
+  memset(json_string + depth, ']', depth);
+  json_string[depth * 2] = '\0';
+
+  struct JsonToken *token = jsontok_parse_deep(json_string, depth - 1, &error);
+  assert(token == NULL);
+  assert(error == JSON_EDEPTH);
+
+  token = jsontok_parse_deep(json_string, depth, &error);
+  assert(token != NULL);
+  assert(token->type == JSON_ARRAY);
+  assert(token->as_array->length == 1);
+
+  jsontok_free(token);
+  free(json_string);
+
+  token = jsontok_parse_deep("[[1]]", SIZE_MAX / 2 + 2, &error);
+  assert(token == NULL);
+  assert(error == JSON_ENOMEM);
+}
+
+struct SaxTally {
+  double sum;
+  size_t keys;
+  size_t strings;
+  size_t containers;
+};
+
+enum JsonSaxAction sax_tally_number(void *ctx, double number) {
+  ((struct SaxTally *)ctx)->sum += number;
+  return JSON_SAX_CONTINUE;
+}
+
+enum JsonSaxAction sax_tally_key(void *ctx, const char *key, size_t length) {
+  ((struct SaxTally *)ctx)->keys++;
+  return length == 4 && !strncmp(key, "skip", 4) ? JSON_SAX_SKIP : JSON_SAX_CONTINUE;
+}
+
+enum JsonSaxAction sax_tally_string(void *ctx, const char *string, size_t length) {
+  (void)string;
+  (void)length;
+  ((struct SaxTally *)ctx)->strings++;
+  return JSON_SAX_CONTINUE;
+}
+
+enum JsonSaxAction sax_tally_start_array(void *ctx) {
+  ((struct SaxTally *)ctx)->containers++;
+  return ((struct SaxTally *)ctx)->containers > 1 ? JSON_SAX_SKIP : JSON_SAX_CONTINUE;
+}
+
+void test_sax_parse() {
+  struct JsonSaxHandler handler;
+  struct SaxTally tally;
+  memset(&handler, 0, sizeof(handler));
+  memset(&tally, 0, sizeof(tally));
+  handler.number = sax_tally_number;
+  handler.key = sax_tally_key;
+  handler.string = sax_tally_string;
+  handler.start_array = sax_tally_start_array;
+
+  const char *json_string = "{\"a\":1.5,\"skip\":{\"b\":\"}\",\"c\":100},\"d\":[2,[100,\"]\"],-0.5e1,\"x\"],\"e\":true}";
+  enum JsonError error = jsontok_sax_parse(json_string, strlen(json_string), &handler, &tally);
+  assert(error == JSON_ENOERR);
+  assert(tally.sum == 1.5 + 2 - 5);
+  assert(tally.keys == 4);
+  assert(tally.strings == 1);
+  assert(tally.containers == 2);
+
+  memset(&tally, 0, sizeof(tally));
+  error = jsontok_sax_parse("[1,2]3", 5, &handler, &tally);
+  assert(error == JSON_ENOERR);
+  assert(tally.sum == 3);
+
+  memset(&tally, 0, sizeof(tally));
+  error = jsontok_sax_parse("  42", 4, &handler, &tally);
+  assert(error == JSON_ENOERR);
+  assert(tally.sum == 42);
+
+  error = jsontok_sax_parse("[1,2,]", 6, &handler, &tally);
+  assert(error == JSON_EFMT);
+  error = jsontok_sax_parse("{\"a\" 1}", 7, &handler, &tally);
+  assert(error == JSON_EFMT);
+  json_string = "{\"skip\":[1},\"x\":2}";
+  error = jsontok_sax_parse(json_string, strlen(json_string), &handler, &tally);
+  assert(error == JSON_EFMT);
+}
+
+void test_cursor() {
+  const char *json_string = "{\"skip\":{\"a\":[1,2]},\"list\":[{\"id\":1},{\"id\":2,\"name\":\"two\"}],\"after\":null}";
+  struct JsonCursor cursor = jsontok_cursor_init(json_string, strlen(json_string));
+  struct JsonEvent event;
+
+  assert(jsontok_cursor_next(&cursor, &event));
+  assert(event.type == JSON_EVENT_START_OBJECT);
+  assert(jsontok_cursor_next(&cursor, &event));
+  assert(event.type == JSON_EVENT_KEY);
+  assert(event.length == 4 && !strncmp(event.string, "skip", 4));
+  assert(jsontok_cursor_skip(&cursor));
+
+  assert(jsontok_cursor_next(&cursor, &event));
+  assert(event.type == JSON_EVENT_KEY);
+  assert(event.length == 4 && !strncmp(event.string, "list", 4));
+  assert(jsontok_cursor_next(&cursor, &event));
+  assert(event.type == JSON_EVENT_START_ARRAY);
+
+  double found = 0;
+  while (jsontok_cursor_next(&cursor, &event) && event.type != JSON_EVENT_END_ARRAY) {
+    assert(event.type == JSON_EVENT_START_OBJECT);
+    assert(jsontok_cursor_next(&cursor, &event));
+    assert(event.type == JSON_EVENT_KEY);
+    assert(jsontok_cursor_next(&cursor, &event));
+    assert(event.type == JSON_EVENT_NUMBER);
+    found = event.number;
+    assert(jsontok_cursor_skip(&cursor) == 0);
+    if (found == 2) break;
+    assert(jsontok_cursor_next(&cursor, &event));
+    assert(event.type == JSON_EVENT_END_OBJECT);
+  }
+  assert(found == 2);
+  assert(cursor.error == JSON_ENOERR);
+
+  cursor = jsontok_cursor_init("[{\"a\":[]}, 3", 13);
+  assert(jsontok_cursor_next(&cursor, &event));
+  assert(jsontok_cursor_next(&cursor, &event));
+  assert(event.type == JSON_EVENT_START_OBJECT);
+  assert(jsontok_cursor_skip(&cursor));
+  assert(jsontok_cursor_next(&cursor, &event));
+  assert(event.type == JSON_EVENT_NUMBER && event.number == 3);
+  assert(!jsontok_cursor_next(&cursor, &event));
+  assert(cursor.error == JSON_EFMT);
+
+  cursor = jsontok_cursor_init("[{\"a\":[1}}]", 12);
+  assert(jsontok_cursor_next(&cursor, &event));
+  assert(jsontok_cursor_next(&cursor, &event));
+  assert(event.type == JSON_EVENT_START_OBJECT);
+  assert(!jsontok_cursor_skip(&cursor));
+  assert(cursor.error == JSON_EFMT);
+
+  /* Numbers are converted within the buffer, and tiny ones are accepted like the tree parser does */
+  char hex[2] = {'0', 'x'};
+  cursor = jsontok_cursor_init(hex, sizeof(hex));
+  assert(jsontok_cursor_next(&cursor, &event));
+  assert(event.type == JSON_EVENT_NUMBER && event.number == 0);
+  assert(cursor.ptr == hex + 1);
+  assert(!jsontok_cursor_next(&cursor, &event));
+  cursor = jsontok_cursor_init("[1e-400,1e400]", 14);
+  assert(jsontok_cursor_next(&cursor, &event));
+  assert(jsontok_cursor_next(&cursor, &event));
+  assert(event.type == JSON_EVENT_NUMBER && event.number == 0);
+  assert(!jsontok_cursor_next(&cursor, &event));
+  assert(cursor.error == JSON_EFMT);
+}
+
+struct CountingAllocator {
+  size_t allocations;
+  size_t live;
+};
+
+void *counting_alloc(void *ctx, size_t size) {
+  ((struct CountingAllocator *)ctx)->allocations++;
+  ((struct CountingAllocator *)ctx)->live++;
+  return malloc(size);
+}
+
+void *counting_realloc(void *ctx, void *ptr, size_t size) {
+  if (!ptr) {
+    ((struct CountingAllocator *)ctx)->allocations++;
+    ((struct CountingAllocator *)ctx)->live++;
+  }
+  return realloc(ptr, size);
+}
+
+void counting_free(void *ctx, void *ptr) {
+  ((struct CountingAllocator *)ctx)->live--;
+  free(ptr);
+}
+
+/* Makes parser allocate through allocator, which counts into counts */
+static void init_counting_parser(struct JsonParser *parser, struct JsonAllocator *allocator, struct CountingAllocator *counts) {
+  counts->allocations = 0;
+  counts->live = 0;
+  allocator->alloc = counting_alloc;
+  allocator->realloc = counting_realloc;
+  allocator->free = counting_free;
+  allocator->ctx = counts;
+  memset(parser, 0, sizeof(*parser));
+  parser->allocator = allocator;
+}
+
+void test_parser_allocator() {
+  enum JsonError error = JSON_ENOERR;
+  struct CountingAllocator counts;
+  struct JsonAllocator allocator;
+  struct JsonParser parser;
+  init_counting_parser(&parser, &allocator, &counts);
+
+  const char *json_string = "{\"key\":\"value\",\"array\":[1,{\"inner\":[true,\"x\"]}],\"nested\":{\"inner_key\":\"inner_value\"}}";
+  struct JsonToken *token = jsontok_parser_parse(&parser, json_string, &error);
+  assert(token != NULL);
+  assert(counts.allocations > 0);
+  jsontok_parser_free(&parser, token);
+  assert(counts.live == 0);
+
+  counts.allocations = 0;
+  token = jsontok_parser_parse_deep(&parser, json_string, &error);
+  assert(token != NULL);
+  assert(jsontok_get(token->as_object, "array")->type == JSON_ARRAY);
+  assert(counts.allocations > 0);
+  jsontok_parser_free(&parser, token);
+  assert(counts.live == 0);
+
+  char insitu_string[] = "{\"key\":\"value\",\"nested\":{\"inner_key\":\"inner_value\"}}";
+  token = jsontok_parser_parse_insitu(&parser, insitu_string, &error);
+  assert(token != NULL);
+  jsontok_parser_free(&parser, token);
+  assert(counts.live == 0);
+
+  token = jsontok_parser_parse(&parser, json_string, &error);
+  assert(token != NULL);
+  struct JsonToken *nested = jsontok_get(token->as_object, "nested");
+  assert(jsontok_parser_expand(&parser, nested) == JSON_ENOERR);
+  assert(nested->type == JSON_OBJECT);
+  assert(strcmp(jsontok_get(nested->as_object, "inner_key")->as_string, "inner_value") == 0);
+  assert(jsontok_parser_expand(&parser, nested) == JSON_ETYPE);
+  jsontok_parser_free(&parser, token);
+  assert(counts.live == 0);
+
+  assert(jsontok_parser_parse_deep(&parser, "{\"key\":[1,{\"a\":2},]}", &error) == NULL);
+  assert(error == JSON_EFMT);
+  assert(jsontok_parser_parse(&parser, "{\"key\":\"value\",\"bad\":tru}", &error) == NULL);
+  assert(counts.live == 0);
+  assert(jsontok_parser_parse(&parser, "{\"a\":[1,2]} x", &error) == NULL);
+  assert(error == JSON_EFMT);
+  assert(jsontok_parser_parse(&parser, "\"value\" x", &error) == NULL);
+  assert(counts.live == 0);
+}
+
+void test_parser_limits() {
+  enum JsonError error = JSON_ENOERR;
+  struct CountingAllocator counts;
+  struct JsonAllocator allocator;
+  struct JsonParser parser;
+  init_counting_parser(&parser, &allocator, &counts);
+
+  const char *json_string = "{\"key\":\"value\",\"list\":[1,2,3,4],\"nested\":{\"inner\":[true,{\"deep\":null}]}}";
+  struct JsonToken *token = jsontok_parser_parse_deep(&parser, json_string, &error);
+  assert(token != NULL);
+  jsontok_parser_free(&parser, token);
+
+  parser.max_tokens = 8;
+  assert(jsontok_parser_parse_deep(&parser, json_string, &error) == NULL);
+  assert(error == JSON_ELIMIT);
+  parser.max_tokens = 3;
+  assert(jsontok_parser_parse(&parser, json_string, &error) == NULL);
+  assert(error == JSON_ELIMIT);
+  assert(counts.live == 0);
+  parser.max_tokens = 0;
+
+  parser.max_string_length = 4;
+  assert(jsontok_parser_parse(&parser, json_string, &error) == NULL);
+  assert(error == JSON_ELIMIT);
+  assert(jsontok_parser_parse(&parser, "{\"long key\":1}", &error) == NULL);
+  assert(error == JSON_ELIMIT);
+  parser.flags = JSON_PARSE_LAZY;
+  assert(jsontok_parser_parse(&parser, "[\"12345\"]", &error) == NULL);
+  assert(error == JSON_ELIMIT);
+  parser.flags = 0;
+  char insitu_string[] = "[\"a\\\"bcd\"]";
+  assert(jsontok_parser_parse_insitu(&parser, insitu_string, &error) == NULL);
+  assert(error == JSON_ELIMIT);
+  /* The decode stops at the fifth byte, before it could reach the missing quote */
+  char oversized[] = "[\"ab\\ncdefgh";
+  assert(jsontok_parser_parse_insitu(&parser, oversized, &error) == NULL);
+  assert(error == JSON_ELIMIT);
+  char exact[] = "[\"a\\nb\"]";
+  token = jsontok_parser_parse_insitu(&parser, exact, &error);
+  assert(token != NULL && strcmp(token->as_array->elements[0]->as_string, "a\nb") == 0);
+  jsontok_parser_free(&parser, token);
+  token = jsontok_parser_parse(&parser, "[\"abcd\"]", &error);
+  assert(token != NULL);
+  jsontok_parser_free(&parser, token);
+  assert(counts.live == 0);
+  parser.max_string_length = 0;
+
+  parser.max_document_size = 16;
+  assert(jsontok_parser_parse(&parser, json_string, &error) == NULL);
+  assert(error == JSON_ELIMIT);
+  token = jsontok_parser_parse(&parser, "[1,2,3]", &error);
+  assert(token != NULL);
+  jsontok_parser_free(&parser, token);
+  parser.max_document_size = 0;
+
+  parser.max_bytes = 256;
+  assert(jsontok_parser_parse_deep(&parser, json_string, &error) == NULL);
+  assert(error == JSON_ELIMIT);
+  assert(counts.live == 0);
+  parser.max_bytes = 1 << 16;
+  token = jsontok_parser_parse_deep(&parser, json_string, &error);
+  assert(token != NULL);
+  jsontok_parser_free(&parser, token);
+  assert(counts.live == 0);
+
+  /* Wide input is cut off as soon as it goes over, whatever its total size */
+  size_t count = 1 << 19;
+  char *wide = malloc(2 * count + 2);
+  size_t i;
+  assert(wide != NULL);
+  wide[0] = '[';
+  for (i = 0; i < count; i++) {
+    wide[1 + 2 * i] = '1';
+    wide[2 + 2 * i] = i + 1 < count ? ',' : ']';
+  }
+  wide[2 * count + 1] = '\0';
+  parser.max_bytes = 1 << 16;
+  assert(jsontok_parser_parse(&parser, wide, &error) == NULL);
+  assert(error == JSON_ELIMIT);
+  assert(counts.live == 0);
+  parser.max_bytes = 0;
+  token = jsontok_parser_parse(&parser, wide, &error);
+  assert(token != NULL);
+  assert(token->as_array->length == count);
+  jsontok_parser_free(&parser, token);
+  assert(counts.live == 0);
+  free(wide);
+}
+
+void test_parse_lazy() {
+  enum JsonError error = JSON_ENOERR;
+  struct CountingAllocator counts;
+  struct JsonAllocator allocator;
+  struct JsonParser parser;
+  init_counting_parser(&parser, &allocator, &counts);
+  parser.flags = JSON_PARSE_LAZY;
+
+  const char *json_string = "{\"name\":\"plain\",\"escaped\":\"a\\nb\\u00e9\",\"id\":-9223372036854775808,\"big\":9223372036854775808,\"ratio\":2.5e1,\"exact\":9007199254740993,\"huge\":-1e30}";
+  struct JsonToken *token = jsontok_parser_parse(&parser, json_string, &error);
+  assert(token != NULL);
+  struct JsonToken *name = jsontok_get(token->as_object, "name");
+  struct JsonToken *escaped = jsontok_get(token->as_object, "escaped");
+  struct JsonToken *id = jsontok_get(token->as_object, "id");
+  struct JsonToken *ratio = jsontok_get(token->as_object, "ratio");
+  assert(name->type == JSON_STRING && name->lazy);
+  assert(name->as_raw == strstr(json_string, "\"plain\""));
+  assert(strcmp(jsontok_as_string(&parser, name, &error), "plain") == 0);
+  assert(!name->lazy);
+  assert(strcmp(jsontok_as_string(&parser, escaped, &error), "a\n" "b\xC3\xA9") == 0);
+  assert(jsontok_as_int64(id, &error) == INT64_MIN);
+  assert(!id->lazy && id->integer && id->as_int64 == INT64_MIN);
+  assert(jsontok_as_double(id, &error) == -9223372036854775808.0);
+  struct JsonToken *exact = jsontok_get(token->as_object, "exact");
+  assert(jsontok_as_int64(exact, &error) == 9007199254740993LL);
+  assert(jsontok_as_int64(exact, &error) == 9007199254740993LL);
+  assert(jsontok_as_int64(jsontok_get(token->as_object, "huge"), &error) == 0);
+  assert(error == JSON_ETYPE);
+  assert(jsontok_as_int64(jsontok_get(token->as_object, "big"), &error) == 0);
+  assert(error == JSON_ETYPE);
+  assert(jsontok_as_int64(ratio, &error) == 25);
+  assert(jsontok_as_double(ratio, &error) == 25.0);
+  assert(jsontok_as_double(name, &error) == 0);
+  assert(error == JSON_ETYPE);
+  jsontok_parser_free(&parser, token);
+  assert(counts.live == 0);
+
+  char insitu_string[] = "[\"x\\ty\",1.5]";
+  token = jsontok_parser_parse_insitu(&parser, insitu_string, &error);
+  assert(token != NULL);
+  assert(strcmp(jsontok_as_string(&parser, token->as_array->elements[0], &error), "x\ty") == 0);
+  assert(jsontok_as_double(token->as_array->elements[1], &error) == 1.5);
+  jsontok_parser_free(&parser, token);
+  assert(counts.live == 0);
+
+  assert(jsontok_parser_parse(&parser, "{\"key\":\"unterminated}", &error) == NULL);
+  assert(error == JSON_EFMT);
+  assert(counts.live == 0);
+
+  /* Keys without escapes stay in the input until copied out */
+  json_string = "{\"name\":1,\"na\":2,\"esc\\u0061ped\":3,\"inner\":{\"deep\":4}}";
+  token = jsontok_parser_parse_deep(&parser, json_string, &error);
+  assert(token != NULL);
+  struct JsonEntry *entry = token->as_object->entries[0];
+  assert(entry->lazy && entry->key == strstr(json_string, "name") && entry->key_length == 4);
+  assert(jsontok_as_int64(jsontok_get(token->as_object, "na"), &error) == 2);
+  assert(jsontok_as_int64(jsontok_get(token->as_object, "name"), &error) == 1);
+  assert(jsontok_get(token->as_object, "nam") == NULL);
+  assert(!token->as_object->entries[2]->lazy);
+  assert(jsontok_as_int64(jsontok_get(token->as_object, "escaped"), &error) == 3);
+  assert(jsontok_get(jsontok_get(token->as_object, "inner")->as_object, "deep") != NULL);
+  assert(strcmp(jsontok_entry_key(&parser, entry, &error), "name") == 0);
+  assert(!entry->lazy && entry->key_length == 4);
+  assert(jsontok_get(token->as_object, "name") == entry->value);
+  jsontok_parser_free(&parser, token);
+  assert(counts.live == 0);
+}
+
+void test_minify() {
+  enum JsonError error = JSON_ENOERR;
+  const char *json_string = "{\n  \"key\" : \"a value with  spaces\",\n  \"escaped\": \"quote \\\" and \\\\\" ,\n\t\"list\": [ 1, 2,\r\n 3 ]\n}";
+  const char *expected = "{\"key\":\"a value with  spaces\",\"escaped\":\"quote \\\" and \\\\\",\"list\":[1,2,3]}";
+  char out[256];
+  size_t length = jsontok_minify(json_string, strlen(json_string), out);
+  assert(length == strlen(expected));
+  assert(memcmp(out, expected, length) == 0);
+
+  char insitu[256];
+  strcpy(insitu, json_string);
+  length = jsontok_minify(insitu, strlen(insitu), insitu);
+  assert(length == strlen(expected));
+  assert(memcmp(insitu, expected, length) == 0);
+
+  /* Long runs inside and outside strings exercise the block copies */
+  char long_string[] = "[\"                                        \",                                                   \"x\\\"                  y\"]";
+  const char *long_expected = "[\"                                        \",\"x\\\"                  y\"]";
+  length = jsontok_minify(long_string, strlen(long_string), long_string);
+  assert(length == strlen(long_expected));
+  assert(memcmp(long_string, long_expected, length) == 0);
+
+  struct JsonParser parser;
+  memset(&parser, 0, sizeof(parser));
+  parser.flags = JSON_PARSE_MINIFY;
+  struct JsonToken *token = jsontok_parser_parse(&parser, "{\"nested\": {\n  \"key\": \"a b\",\n  \"arr\": [ 1, 2 ]\n}, \"arr\": [ true, null ]}", &error);
+  assert(token != NULL);
+  assert(strcmp(jsontok_get(token->as_object, "nested")->as_string, "{\"key\":\"a b\",\"arr\":[1,2]}") == 0);
+  assert(strcmp(jsontok_get(token->as_object, "arr")->as_string, "[true,null]") == 0);
+  jsontok_parser_free(&parser, token);
+}
+
+#ifdef JSONTOK_POSIX
+void test_snapshot() {
+  enum JsonError error = JSON_ENOERR;
+  const char *json_string = "{\"key\":\"value\",\"number\":42,\"array\":[1,true,null,{\"deep\":\"x\"}],\"nested\":{\"inner_key\":\"inner_value\"},\"empty\":{}}";
+  struct JsonToken *token = jsontok_parse(json_string, &error);
+  assert(token != NULL);
+
+  char path[] = "/tmp/jsontok_snapshot_XXXXXX";
+  int fd = mkstemp(path);
+  assert(fd >= 0);
+  assert(jsontok_snapshot_write(token, fd) == JSON_ENOERR);
+  close(fd);
+  jsontok_free(token);
+
+  struct JsonSnapshot *snapshot = jsontok_snapshot_open(path, &error);
+  unlink(path);
+  assert(snapshot != NULL);
+
+  const struct JsonSnapshotNode *root = jsontok_snapshot_root(snapshot);
+  assert(jsontok_snapshot_type(root) == JSON_OBJECT);
+  assert(jsontok_snapshot_length(root) == 5);
+  assert(strcmp(jsontok_snapshot_key(root, 2), "array") == 0);
+
+  const struct JsonSnapshotNode *value = jsontok_snapshot_get(root, "key");
+  assert(value != NULL);
+  assert(jsontok_snapshot_type(value) == JSON_STRING);
+  assert(strcmp(jsontok_snapshot_string(value), "value") == 0);
+  assert(jsontok_snapshot_number(jsontok_snapshot_get(root, "number")) == 42);
+  assert(jsontok_snapshot_get(root, "missing") == NULL);
+
+  const struct JsonSnapshotNode *array = jsontok_snapshot_get(root, "array");
+  assert(jsontok_snapshot_type(array) == JSON_ARRAY);
+  assert(jsontok_snapshot_length(array) == 4);
+  assert(jsontok_snapshot_boolean(jsontok_snapshot_element(array, 1)) == 1);
+  assert(jsontok_snapshot_type(jsontok_snapshot_element(array, 2)) == JSON_NULL);
+  assert(strcmp(jsontok_snapshot_string(jsontok_snapshot_get(jsontok_snapshot_element(array, 3), "deep")), "x") == 0);
+  assert(jsontok_snapshot_element(array, 4) == NULL);
+
+  const struct JsonSnapshotNode *nested = jsontok_snapshot_get(root, "nested");
+  assert(strcmp(jsontok_snapshot_string(jsontok_snapshot_get(nested, "inner_key")), "inner_value") == 0);
+  assert(jsontok_snapshot_length(jsontok_snapshot_get(root, "empty")) == 0);
+
+  jsontok_snapshot_close(snapshot);
+
+  struct JsonParser parser;
+  memset(&parser, 0, sizeof(parser));
+  parser.flags = JSON_PARSE_LAZY;
+  token = jsontok_parser_parse(&parser, "{\"text\":\"a\\\"b\",\"number\":1e2}", &error);
+  assert(token != NULL);
+  strcpy(path, "/tmp/jsontok_snapshot_XXXXXX");
+  fd = mkstemp(path);
+  assert(fd >= 0);
+  assert(jsontok_snapshot_write(token, fd) == JSON_ENOERR);
+  close(fd);
+  jsontok_parser_free(&parser, token);
+  snapshot = jsontok_snapshot_open(path, &error);
+  unlink(path);
+  assert(snapshot != NULL);
+  root = jsontok_snapshot_root(snapshot);
+  assert(strcmp(jsontok_snapshot_string(jsontok_snapshot_get(root, "text")), "a\"b") == 0);
+  assert(jsontok_snapshot_length(jsontok_snapshot_get(root, "text")) == 3);
+  assert(jsontok_snapshot_number(jsontok_snapshot_get(root, "number")) == 100);
+  jsontok_snapshot_close(snapshot);
+}
+
+void test_cache() {
+  enum JsonError error = JSON_ENOERR;
+  struct JsonCacheStats stats;
+  struct JsonCache *cache = jsontok_cache_create(1 << 20);
+  assert(cache != NULL);
+
+  char first[] = "{\"key\":\"value\",\"nested\":{\"inner_key\":\"inner_value\"}}";
+  char second[] = "{\"key\":\"value\",\"nested\":{\"inner_key\":\"inner_value\"}}";
+  const struct JsonToken *token = jsontok_cache_parse(cache, first, &error);
+  assert(token != NULL);
+  assert(strcmp(jsontok_get(token->as_object, "key")->as_string, "value") == 0);
+  const struct JsonToken *shared = jsontok_cache_parse(cache, second, &error);
+  assert(shared == token);
+  const struct JsonToken *other = jsontok_cache_parse(cache, "[1,2]", &error);
+  assert(other != NULL && other != token);
+  assert(jsontok_cache_parse(cache, "[1,2,", &error) == NULL);
+  assert(error == JSON_EFMT);
+
+  jsontok_cache_stats(cache, &stats);
+  assert(stats.hits == 1);
+  assert(stats.misses == 3);
+  assert(stats.entries == 2);
+  assert(stats.evictions == 0);
+
+  jsontok_cache_release(cache, token);
+  jsontok_cache_release(cache, shared);
+  jsontok_cache_release(cache, other);
+  jsontok_cache_destroy(cache);
+
+  cache = jsontok_cache_create(0);
+  token = jsontok_cache_parse(cache, first, &error);
+  other = jsontok_cache_parse(cache, "[1,2]", &error);
+  jsontok_cache_stats(cache, &stats);
+  assert(stats.entries == 2);
+  jsontok_cache_release(cache, token);
+  jsontok_cache_stats(cache, &stats);
+  assert(stats.entries == 1);
+  assert(stats.evictions == 1);
+  jsontok_cache_release(cache, other);
+  jsontok_cache_destroy(cache);
+}
+
+void *cache_worker(void *cache) {
+  const char *payloads[] = {"{\"a\":1}", "{\"b\":[2]}", "{\"c\":\"3\"}"};
+  enum JsonError error;
+  size_t i;
+  for (i = 0; i < 3000; i++) {
+    const struct JsonToken *token = jsontok_cache_parse(cache, payloads[i % 3], &error);
+    assert(token != NULL);
+    assert(token->as_object->count == 1);
+    jsontok_cache_release(cache, token);
+  }
+  return NULL;
+}
+
+void test_cache_threads() {
+  struct JsonCacheStats stats;
+  struct JsonCache *cache = jsontok_cache_create(1 << 20);
+  pthread_t threads[4];
+  size_t i;
+  for (i = 0; i < 4; i++) assert(pthread_create(&threads[i], NULL, cache_worker, cache) == 0);
+  for (i = 0; i < 4; i++) pthread_join(threads[i], NULL);
+  jsontok_cache_stats(cache, &stats);
+  assert(stats.hits + stats.misses == 12000);
+  assert(stats.entries == 3);
+  jsontok_cache_destroy(cache);
+}
+
+unsigned char tokens_equal(const struct JsonToken *a, const struct JsonToken *b) {
+  size_t i;
+  if (a->type != b->type) return 0;
+  switch (a->type) {
+    case JSON_NUMBER:
+      return a->as_number == b->as_number;
+    case JSON_BOOLEAN:
+      return a->as_boolean == b->as_boolean;
+    case JSON_NULL:
+      return 1;
+    case JSON_ARRAY:
+      if (a->as_array->length != b->as_array->length) return 0;
+      for (i = 0; i < a->as_array->length; i++) {
+        if (!tokens_equal(a->as_array->elements[i], b->as_array->elements[i])) return 0;
+      }
+      return 1;
+    case JSON_OBJECT:
+      if (a->as_object->count != b->as_object->count) return 0;
+      for (i = 0; i < a->as_object->count; i++) {
+        const struct JsonEntry *x = a->as_object->entries[i], *y = b->as_object->entries[i];
+        if (x->key_length != y->key_length || memcmp(x->key, y->key, x->key_length)) return 0;
+        if (!tokens_equal(a->as_object->entries[i]->value, b->as_object->entries[i]->value)) return 0;
+      }
+      return 1;
+    default:
+      return strcmp(a->as_string, b->as_string) == 0;
+  }
+}
+
+struct StringSource {
+  const char *json;
+  size_t step;
+  unsigned char fail;
+};
+
+size_t string_read(void *ctx, char *buffer, size_t size) {
+  struct StringSource *source = ctx;
+  size_t length = strlen(source->json);
+  if (length == 0 && source->fail) return (size_t)-1;
+  if (length > source->step) length = source->step;
+  if (length > size) length = size;
+  memcpy(buffer, source->json, length);
+  source->json += length;
+  return length;
+}
+
+void test_parse_source() {
+  const char *documents[] = {
+      "{\"key\":\"value\",\"number\":-12.5e1,\"nested\":{\"a\":[1,2,{\"b\":\"}\"}]},\"list\":[true,false,null],\"escaped\":\"\\\"\\\\\"}",
+      "  [ 1 , \"two\" , [3, [4]] , {\"five\": 5} , true , 123456789 ]  ",
+      "[{\"s\":\"a\\\"]}\\\\\"},[[]],-0.5]",
+      "{}", "[]", "\"scalar\"", "42", " true "};
+  const char *invalid[] = {
+      "{\"key\":}", "[1,,2]", "[1 2]", "{\"a\":[1,2}}", "[[1}]", "{\"key\" 1}", "[1,2", "{\"key\":\"value\"} x", "[tru]", "", "[1]]"};
+  size_t steps[] = {1, 3, 7, 1 << 20};
+  size_t i, j;
+  struct CountingAllocator counts;
+  struct JsonAllocator allocator;
+  struct JsonParser parser;
+  init_counting_parser(&parser, &allocator, &counts);
+  for (i = 0; i < sizeof(documents) / sizeof(documents[0]); i++) {
+    enum JsonError expected_error = JSON_ENOERR;
+    struct JsonToken *expected = jsontok_parse(documents[i], &expected_error);
+    assert(expected != NULL);
+    for (j = 0; j < sizeof(steps) / sizeof(steps[0]); j++) {
+      enum JsonError error = JSON_ENOERR;
+      struct StringSource string_source;
+      struct JsonSource source;
+      string_source.json = documents[i];
+      string_source.step = steps[j];
+      string_source.fail = 0;
+      source.read = string_read;
+      source.ctx = &string_source;
+      struct JsonToken *token = jsontok_parser_parse_source(&parser, &source, &error);
+      assert(token != NULL);
+      assert(tokens_equal(token, expected));
+      jsontok_parser_free(&parser, token);
+      assert(counts.live == 0);
+    }
+    jsontok_free(expected);
+  }
+  for (i = 0; i < sizeof(invalid) / sizeof(invalid[0]); i++) {
+    for (j = 0; j < sizeof(steps) / sizeof(steps[0]); j++) {
+      enum JsonError error = JSON_ENOERR;
+      struct StringSource string_source;
+      struct JsonSource source;
+      string_source.json = invalid[i];
+      string_source.step = steps[j];
+      string_source.fail = 0;
+      source.read = string_read;
+      source.ctx = &string_source;
+      assert(jsontok_parser_parse_source(&parser, &source, &error) == NULL);
+      assert(error == JSON_EFMT);
+      assert(counts.live == 0);
+    }
+  }
+
+  enum JsonError error = JSON_ENOERR;
+  struct StringSource string_source;
+  struct JsonSource source;
+  string_source.json = documents[0];
+  string_source.step = 7;
+  string_source.fail = 0;
+  source.read = string_read;
+  source.ctx = &string_source;
+  parser.max_document_size = 16;
+  assert(jsontok_parser_parse_source(&parser, &source, &error) == NULL);
+  assert(error == JSON_ELIMIT);
+  assert(counts.live == 0);
+  parser.max_document_size = 0;
+
+  string_source.json = "[1,2,3";
+  string_source.step = 2;
+  string_source.fail = 1;
+  source.read = string_read;
+  source.ctx = &string_source;
+  assert(jsontok_parser_parse_source(&parser, &source, &error) == NULL);
+  assert(error == JSON_EIO);
+  assert(counts.live == 0);
+
+  /* Members of a chunk or more become wrapped tokens without being copied again */
+  char *large = malloc(1 << 20);
+  size_t length = 0;
+  assert(large != NULL);
+  length += sprintf(large, "{\"kind\": \"listing\", \"data\": {\"children\": [");
+  for (i = 0; i < 4000; i++) length += sprintf(large + length, "%s{ \"id\": %lu, \"text\": \"a  b\" }", i ? ", " : "", (unsigned long)i);
+  length += sprintf(large + length, "]}, \"more\": [");
+  for (i = 0; i < 5000; i++) length += sprintf(large + length, "%s[ %lu, \"c  d\" ]", i ? ", " : "", (unsigned long)i);
+  length += sprintf(large + length, "], \"after\": [1, 2]}");
+  for (j = 0; j < 2; j++) {
+    struct JsonToken *expected;
+    parser.flags = j ? JSON_PARSE_MINIFY : 0;
+    expected = jsontok_parser_parse(&parser, large, &error);
+    assert(expected != NULL);
+    string_source.json = large;
+    string_source.step = 5000;
+    string_source.fail = 0;
+    struct JsonToken *token = jsontok_parser_parse_source(&parser, &source, &error);
+    assert(token != NULL);
+    assert(tokens_equal(token, expected));
+    jsontok_parser_free(&parser, token);
+    jsontok_parser_free(&parser, expected);
+    assert(counts.live == 0);
+  }
+  parser.flags = 0;
+  string_source.json = large;
+  parser.max_bytes = 100000;
+  assert(jsontok_parser_parse_source(&parser, &source, &error) == NULL);
+  assert(error == JSON_ELIMIT);
+  assert(counts.live == 0);
+  free(large);
+}
+
+#ifdef JSONTOK_ZLIB
+void test_parse_gzip_file() {
+  enum JsonError error = JSON_ENOERR;
+  size_t length = 0;
+  size_t i;
+  char *json = malloc(1 << 20);
+  assert(json != NULL);
+  /* Large enough to span many chunks of the pipeline */
+  json[length++] = '[';
+  for (i = 0; i < 20000; i++) {
+    length += sprintf(json + length, "%s{\"id\":%lu,\"name\":\"record %lu\",\"tags\":[\"a\",\"b\"]}", i ? "," : "", (unsigned long)i, (unsigned long)i);
+  }
+  json[length++] = ']';
+  json[length] = '\0';
+
+  char path[] = "/tmp/jsontok_gzip_XXXXXX";
+  int fd = mkstemp(path);
+  assert(fd >= 0);
+  gzFile file = gzdopen(fd, "wb");
+  assert(file != NULL);
+  assert(gzwrite(file, json, (unsigned int)length) == (int)length);
+  gzclose(file);
+
+  struct JsonToken *expected = jsontok_parse(json, &error);
+  struct JsonToken *token = jsontok_parse_gzip_file(path, &error);
+  unlink(path);
+  assert(token != NULL);
+  assert(token->as_array->length == 20000);
+  assert(tokens_equal(token, expected));
+  jsontok_free(token);
+  jsontok_free(expected);
+  free(json);
+
+  assert(jsontok_parse_gzip_file("/tmp/jsontok_missing.json.gz", &error) == NULL);
+  assert(error == JSON_EIO);
+}
+#endif
+#endif
+
 int main() {
   printf("Running test_parse_valid_json...");
   test_parse_valid_json();
@@ -105,6 +970,55 @@ int main() {
   printf("Running test_get_nonexistent_key...");
   test_get_nonexistent_key();
   printf(" PASSED\n");
+  printf("Running test_parse_escaped_string...");
+  test_parse_escaped_string();
+  printf(" PASSED\n");
+  printf("Running test_parse_insitu...");
+  test_parse_insitu();
+  printf(" PASSED\n");
+  printf("Running test_parse_deep...");
+  test_parse_deep();
+  printf(" PASSED\n");
+  printf("Running test_parse_deep_nesting...");
+  test_parse_deep_nesting();
+  printf(" PASSED\n");
+  printf("Running test_sax_parse...");
+  test_sax_parse();
+  printf(" PASSED\n");
+  printf("Running test_cursor...");
+  test_cursor();
+  printf(" PASSED\n");
+  printf("Running test_parser_allocator...");
+  test_parser_allocator();
+  printf(" PASSED\n");
+  printf("Running test_parser_limits...");
+  test_parser_limits();
+  printf(" PASSED\n");
+  printf("Running test_parse_lazy...");
+  test_parse_lazy();
+  printf(" PASSED\n");
+  printf("Running test_minify...");
+  test_minify();
+  printf(" PASSED\n");
+#ifdef JSONTOK_POSIX
+  printf("Running test_snapshot...");
+  test_snapshot();
+  printf(" PASSED\n");
+  printf("Running test_cache...");
+  test_cache();
+  printf(" PASSED\n");
+  printf("Running test_cache_threads...");
+  test_cache_threads();
+  printf(" PASSED\n");
+  printf("Running test_parse_source...");
+  test_parse_source();
+  printf(" PASSED\n");
+#ifdef JSONTOK_ZLIB
+  printf("Running test_parse_gzip_file...");
+  test_parse_gzip_file();
+  printf(" PASSED\n");
+#endif
+#endif
 
   return 0;
 }
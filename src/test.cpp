@@ -0,0 +1,139 @@
+#include <cassert>
+#include <cstdio>
+#include <cstring>
+#include <string_view>
+#include <utility>
+
+#include "jsontok.hpp"
+
+#ifdef JSONTOK_POSIX
+#include <unistd.h>
+#endif
+
+using namespace jsontok::literals;
+
+void test_document() {
+  JsonError error = JSON_ENOERR;
+  jsontok::Document document = jsontok::Document::parse("{\"name\":\"jsontok\",\"names\":1,\"nested\":{\"list\":[1,[2,3],\"x\"]},\"flag\":true}", &error);
+  assert(document);
+  assert(document["name"].string() == "jsontok");
+  assert(document["names"].int64() == 1);
+  assert(document["flag"].boolean());
+  assert(!document["missing"]);
+  assert(!document["name"][0]);
+
+  /* Wrapped layers are expanded in place on first access */
+  jsontok::Value nested = document["nested"];
+  assert(nested.token()->type == JSON_WRAPPED_OBJECT);
+  assert(nested.is_object());
+  jsontok::Value list = nested["list"];
+  assert(nested.token()->type == JSON_OBJECT);
+  assert(list.size() == 3);
+  assert(list[1][1].number() == 3);
+  assert(list[2].string() == "x");
+  assert(!list[3]);
+
+  double sum = 0;
+  for (jsontok::Value element : list[1].elements()) sum += element.number();
+  assert(sum == 5);
+  size_t entries = 0;
+  for (jsontok::Entry entry : document.root().entries()) {
+    if (entry.key == "flag") assert(entry.value.is_boolean());
+    entries++;
+  }
+  assert(entries == 4);
+  for (jsontok::Value element : document["name"].elements()) assert(!element);
+
+  jsontok::Document moved = std::move(document);
+  assert(!document);
+  assert(moved["name"].string() == "jsontok");
+  document = std::move(moved);
+  assert(document["nested"]["list"][0].number() == 1);
+
+  assert(!jsontok::Document::parse("{\"key\":}", &error));
+  assert(error == JSON_EFMT);
+}
+
+void test_document_lazy() {
+  JsonParser parser;
+  std::memset(&parser, 0, sizeof(parser));
+  parser.flags = JSON_PARSE_LAZY;
+  const char *json = "{\"id\":9007199254740993,\"text\":\"a\\tb\",\"inner\":{\"text\":\"c\"}}";
+  jsontok::Document document = jsontok::Document::parse(json, nullptr, &parser);
+  assert(document);
+  assert(document["id"].token()->lazy);
+  assert(document["id"].int64() == 9007199254740993LL);
+  assert(document["text"].string() == "a\tb");
+  assert(document["inner"]["text"].string() == "c");
+  assert(document.root().token()->as_object->entries[0]->lazy);
+  std::size_t keys = 0;
+  for (jsontok::Entry entry : document.root().entries()) keys += entry.key.size();
+  assert(keys == 2 + 4 + 5);
+  assert(!document["i"] && !document["texts"]);
+}
+
+void test_key() {
+  constexpr jsontok::Key key = "name";
+  static_assert(key.length() == 4, "literal keys know their length");
+  static_assert(key.hash() == 0x8d39bde6u, "literal keys are hashed at compile time");
+  constexpr jsontok::Key suffixed = "name"_key;
+  static_assert(suffixed.hash() == key.hash(), "both spellings hash alike");
+  std::string_view runtime("name");
+  assert(jsontok::Key(runtime).hash() == key.hash());
+
+  /* Arrays filled at run time are keyed by their contents, not their size */
+  char buffer[64];
+  std::strcpy(buffer, "name");
+  assert(jsontok::Key(buffer).length() == 4);
+  assert(jsontok::Key(buffer).hash() == key.hash());
+  jsontok::Document document = jsontok::Document::parse("{\"id\":1,\"name\":\"x\"}");
+  std::strcpy(buffer, "id");
+  assert(document[buffer].int64() == 1);
+  std::strcpy(buffer, "i");
+  assert(!document[buffer]);
+}
+
+#ifdef JSONTOK_POSIX
+void test_snapshot() {
+  JsonError error = JSON_ENOERR;
+  jsontok::Document document = jsontok::Document::parse("{\"key\":\"value\",\"array\":[1,{\"deep\":\"x\"}]}", &error);
+  assert(document);
+  char path[] = "/tmp/jsontok_snapshot_XXXXXX";
+  int fd = mkstemp(path);
+  assert(fd >= 0);
+  assert(jsontok_snapshot_write(document.root().token(), fd) == JSON_ENOERR);
+  close(fd);
+
+  jsontok::Snapshot snapshot = jsontok::Snapshot::open(path, &error);
+  unlink(path);
+  assert(snapshot);
+  assert(snapshot["key"].string() == "value");
+  assert(snapshot["array"].size() == 2);
+  assert(snapshot["array"][1]["deep"].string() == "x");
+  assert(!snapshot["missing"]);
+  char buffer[64];
+  std::strcpy(buffer, "key");
+  assert(snapshot[buffer].string() == "value");
+  jsontok::Snapshot moved = std::move(snapshot);
+  assert(!snapshot);
+  assert(moved["array"][0].number() == 1);
+}
+#endif
+
+int main() {
+  printf("Running test_document...");
+  test_document();
+  printf(" PASSED\n");
+  printf("Running test_document_lazy...");
+  test_document_lazy();
+  printf(" PASSED\n");
+  printf("Running test_key...");
+  test_key();
+  printf(" PASSED\n");
+#ifdef JSONTOK_POSIX
+  printf("Running test_snapshot...");
+  test_snapshot();
+  printf(" PASSED\n");
+#endif
+  return 0;
+}